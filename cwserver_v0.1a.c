@@ -14,6 +14,11 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -21,16 +26,116 @@
 #include <dirent.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <getopt.h> // Added for getopt.h
 
+// make PROFILE=tiny: limits for routers with a few MB of RAM to spare.
+// Every tunable is wrapped in #ifndef, so single values can still be set with -D.
+#ifdef CW_TINY
+#ifndef LISTENQ
+#define LISTENQ 64
+#endif
+#ifndef MAXLINE
+#define MAXLINE 2048
+#endif
+#ifndef RIO_BUFSIZE
+#define RIO_BUFSIZE 2048
+#endif
+#ifndef CW_MAX_CONNECTIONS
+#define CW_MAX_CONNECTIONS 32
+#endif
+#ifndef CW_THREAD_STACK
+#define CW_THREAD_STACK (128 * 1024)
+#endif
+#ifndef STREAM_ENGINE_THREADS
+#define STREAM_ENGINE_THREADS 1
+#endif
+#ifndef STREAM_QUANTUM
+#define STREAM_QUANTUM (128 * 1024)
+#endif
+#ifndef STREAM_READAHEAD
+#define STREAM_READAHEAD (512 * 1024)
+#endif
+#ifndef STREAM_MIN_SIZE
+#define STREAM_MIN_SIZE (256 * 1024)
+#endif
+#ifndef STREAM_DROP_BEHIND_MIN
+#define STREAM_DROP_BEHIND_MIN (8LL * 1024 * 1024)
+#endif
+#ifndef MANIFEST_OVERLAY_BUCKETS
+#define MANIFEST_OVERLAY_BUCKETS 512
+#endif
+#ifndef MANIFEST_OVERLAY_MAX
+#define MANIFEST_OVERLAY_MAX 8192
+#endif
+#ifndef FLIGHT_RING_SIZE
+#define FLIGHT_RING_SIZE 64
+#endif
+#ifndef ARCHIVE_MAX_DEPTH
+#define ARCHIVE_MAX_DEPTH 64
+#endif
+#ifndef ARCHIVE_CRC_CACHE
+#define ARCHIVE_CRC_CACHE 256
+#endif
+#ifndef UPLOAD_LINGER_MAX
+#define UPLOAD_LINGER_MAX (1024 * 1024)
+#endif
+#ifndef SEARCH_WALK_THREADS
+#define SEARCH_WALK_THREADS 1
+#endif
+#ifndef SEARCH_BATCH
+#define SEARCH_BATCH (16 * 1024)
+#endif
+#ifndef SEARCH_MAX_LIMIT
+#define SEARCH_MAX_LIMIT 200
+#endif
+#ifndef PROXY_MAX_ROUTES
+#define PROXY_MAX_ROUTES 4
+#endif
+#ifndef PROXY_POOL_SIZE
+#define PROXY_POOL_SIZE 2
+#endif
+#ifndef SPLICE_CHUNK
+#define SPLICE_CHUNK (16 * 1024)
+#endif
+#endif
+
+#ifndef CW_MAX_CONNECTIONS
+#define CW_MAX_CONNECTIONS 0 // Concurrent connections incl. streaming jobs, 0 = unlimited; the rest get 503
+#endif
+#ifndef CW_THREAD_STACK
+#define CW_THREAD_STACK 0 // Stack size of every thread in bytes, 0 = system default
+#endif
+
+// Hot/cold placement. With make MIPS16_SPLIT=1 everything is compact mips16
+// code except the request path, which stays MIPS32 for speed.
+#if defined(CW_MIPS16_SPLIT) && defined(__mips__)
+#define CW_HOT  __attribute__((hot, nomips16))
+#define CW_COLD __attribute__((cold, mips16))
+#elif defined(__GNUC__)
+#define CW_HOT  __attribute__((hot))
+#define CW_COLD __attribute__((cold))
+#else
+#define CW_HOT
+#define CW_COLD
+#endif
+
+#ifndef LISTENQ
 #define LISTENQ  1024
+#endif
+#ifndef MAXLINE
 #define MAXLINE 8192 // Increased MAXLINE to 8192 to match previous code
+#endif
+#ifndef RIO_BUFSIZE
 #define RIO_BUFSIZE 8192
+#endif
 
 #ifndef PATH_MAX
 #define PATH_MAX 4096
 #endif
 
+#define ALLOWED_ROOT_PREFIX "/tmp" // Resolved paths must stay below this prefix
+
 typedef struct {
     int rio_fd;
     int rio_cnt;
@@ -41,11 +146,397 @@ typedef struct {
 typedef struct sockaddr SA;
 
 typedef struct http_request {
+    char method[16];     // parse_request scans at most 15 bytes into it
+    char uri[MAXLINE];   // Request target as sent, forwarded as is by the proxy
     char filename[PATH_MAX];
+    char query[MAXLINE]; // Raw query string (without '?'), empty if none
     off_t offset;
     size_t end;
+    bool has_range; // A satisfiable single Range header was sent
+    char if_none_match[72];
+    char if_range[72];      // Only entity tags are compared, a date never matches
+    bool accept_gzip;
+    bool accept_br;
+    long long content_length; // -1 if absent
+    bool chunked;           // Transfer-Encoding: chunked request body
+    bool expect_continue;
+    bool has_content_range; // Content-Range: bytes first-last/total on a request body
+    long long cr_first;     // -1 for "bytes */total"
+    long long cr_last;
+    long long cr_total;
+    char headers[MAXLINE];  // Raw header lines for the proxy
+    size_t headers_len;
+    bool headers_overflow;
+    bool http10;            // HTTP/1.0 client: no chunked responses
+    rio_t rio;              // Connection read buffer, holds the start of the body
 } http_request;
 
+// Buffered writer for Transfer-Encoding: chunked responses.
+// Data is accumulated after a reserved prefix so the chunk-size line
+// can be written in place and every chunk goes out with a single write.
+#define CHUNK_PREFIX 16
+#define CHUNK_BUFSIZE (MAXLINE * 2)
+
+typedef struct {
+    int fd;
+    size_t len;
+    bool failed;
+    bool framed;            // false: plain body delimited by closing the connection
+    char buf[CHUNK_PREFIX + CHUNK_BUFSIZE + 2];
+} chunked_t;
+
+// Compact directory entry used for sorted listings.
+// Names live in a single arena, stat data is filled lazily.
+typedef struct {
+    size_t name_off;        // Into the names arena of the listing
+    bool is_dir;
+    bool has_stat;
+    off_t size;
+    time_t mtime;
+} dir_entry;
+
+typedef enum {
+    SORT_NONE,
+    SORT_NAME,
+    SORT_SIZE,
+    SORT_MTIME
+} dir_sort_key;
+
+// Large-file streaming engine tunables
+#ifndef STREAM_ENGINE_THREADS
+#define STREAM_ENGINE_THREADS 2
+#endif
+#ifndef STREAM_QUANTUM
+#define STREAM_QUANTUM (512 * 1024)            // Max bytes per connection per scheduling turn
+#endif
+#ifndef STREAM_READAHEAD
+#define STREAM_READAHEAD (4 * 1024 * 1024)     // Readahead window ahead of the send cursor
+#endif
+#ifndef STREAM_MIN_SIZE
+#define STREAM_MIN_SIZE (1024 * 1024)          // Smaller bodies are sent inline by the connection thread
+#endif
+#ifndef STREAM_DROP_BEHIND_MIN
+#define STREAM_DROP_BEHIND_MIN (64LL * 1024 * 1024) // Files this large drop cache pages behind the cursor
+#endif
+#ifndef STREAM_IDLE_TIMEOUT
+#define STREAM_IDLE_TIMEOUT 60                 // Seconds without progress before a stream is dropped
+#endif
+#ifndef STREAM_COLD_WAIT_MS
+#define STREAM_COLD_WAIT_MS 200                // Uncached data is left to readahead this long, then read anyway
+#endif
+
+typedef struct stream_job {
+    int out_fd;             // Engine-owned duplicate of the client socket
+    int in_fd;
+    off_t offset;           // Send cursor
+    off_t end;              // One past the last byte to send
+    off_t ra_next;          // Readahead issued up to here
+    off_t dropped;          // Page cache released up to here
+    bool drop_behind;
+    uint64_t cold_since;    // flight_now() when the cursor's page was found uncached, 0: warm
+    dev_t dev;              // drop_behind only: streams of one file share its pages
+    ino_t ino;
+    off_t shared_offset;    // Cursor as last seen by other engines, under stream_drop_lock
+    struct stream_job *drop_next;
+    time_t last_progress;
+    struct stream_job *next;
+} stream_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    stream_job *pending;    // Submitted by connection threads, not yet adopted
+    int wake_pipe[2];
+} stream_engine;
+
+#ifndef ARCHIVE_MAX_DEPTH
+#define ARCHIVE_MAX_DEPTH 256 // Directory levels walked into one archive
+#endif
+#ifndef ARCHIVE_CRC_CACHE
+#define ARCHIVE_CRC_CACHE 4096 // zip checksums remembered across requests
+#endif
+
+typedef enum {
+    ARCHIVE_TAR,
+    ARCHIVE_ZIP
+} archive_format;
+
+typedef struct {
+    size_t path_off;        // Relative path in the names arena
+    size_t path_len;
+    const char *path;
+    bool is_dir;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;        // ETag only
+    mode_t mode;
+    dev_t dev;              // Key of the checksum cache
+    ino_t ino;
+    uint32_t crc;           // zip only, computed on demand
+    bool has_crc;
+    off_t header_off;       // Archive offset of the entry's first header
+} archive_entry;
+
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    uint32_t crc;
+    bool valid;
+} archive_crc_slot;
+
+typedef struct {
+    archive_format format;
+    const char *root;       // Resolved, below ALLOWED_ROOT_PREFIX
+    size_t root_len;
+    archive_entry *entries;
+    size_t count, cap;
+    char *names;
+    size_t names_len, names_cap;
+    off_t total_size;
+    off_t cd_off;           // zip central directory offset
+    int out_fd;
+    off_t pos;              // Archive offset of the next byte produced
+    off_t start, end;       // Requested window [start, end)
+    bool failed;
+} archive_t;
+
+// Web-root manifest written by cwindex (make cwindex) and mmap'ed by -m.
+// Layout: manifest_header, count manifest_entry records sorted by path,
+// then the NUL-terminated path strings. Host byte order; entry_size and
+// the magic reject files built for another ABI or endianness.
+#define MANIFEST_MAGIC 0x464D5743u // "CWMF"
+#define MANIFEST_VERSION 1
+#define MANIFEST_MIME_DEFAULT 0xFF
+#ifndef MANIFEST_OVERLAY_BUCKETS
+#define MANIFEST_OVERLAY_BUCKETS 4096
+#endif
+#ifndef MANIFEST_OVERLAY_MAX
+#define MANIFEST_OVERLAY_MAX 65536 // Past this many changes lookups fall back to the filesystem
+#endif
+
+#define MF_DIR     0x01
+#define MF_GZIP    0x02 // path.gz exists
+#define MF_BROTLI  0x04 // path.br exists
+#define MF_ALLOWED 0x08 // Resolved path passed path_is_allowed() at index time
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t entry_size;
+    uint64_t strings_off;
+    uint64_t strings_len;
+    int64_t built;          // Index time, directories changed after it are rescanned
+} manifest_header;
+
+typedef struct {
+    uint32_t path_off;      // Offset into the string table
+    uint16_t path_len;
+    uint8_t mime;           // Index into meme_types or MANIFEST_MIME_DEFAULT
+    uint8_t flags;          // MF_*
+    uint64_t size;
+    int64_t mtime;
+    uint64_t etag;
+} manifest_entry;
+
+// Changes seen through inotify since the manifest was built
+typedef struct overlay_entry {
+    struct overlay_entry *next;
+    bool exists;
+    bool subtree_reset;     // Manifest records below this path are void
+    bool subtree_unknown;   // Symlink replaced: lookups below it go to the filesystem
+    manifest_entry meta;
+    char path[];
+} overlay_entry;
+
+typedef struct {
+    bool enabled;
+    void *base;
+    size_t len;
+    const manifest_header *hdr;
+    const manifest_entry *entries;
+    const char *strings;
+    volatile bool stale;    // Overlay overflowed or a watch failed: use the filesystem
+    pthread_rwlock_t lock;
+    size_t overlay_count;
+    size_t overlay_unknown; // Entries with subtree_unknown set
+    overlay_entry *overlay[MANIFEST_OVERLAY_BUCKETS];
+} manifest_t;
+
+// Shared inotify watcher for the web root
+#define TREE_WATCH_MAX_LISTENERS 4
+#define TREE_WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | \
+                         IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+// Events that add, remove or replace a name, as opposed to changing its contents
+#define TREE_WATCH_NAMESPACE (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef void (*tree_watch_fn)(const char *path, uint32_t mask); // path is NULL on queue overflow
+
+// Slow-request flight recorder (-T). Every connection thread stamps the
+// monotonic clock at the end of each request stage; requests slower than
+// the threshold are copied into a shared ring (dumped on SIGUSR1) and, with
+// -L, appended to the slow log right away.
+#ifndef FLIGHT_RING_SIZE
+#define FLIGHT_RING_SIZE 256
+#endif
+
+typedef enum {
+    STAGE_ACCEPT,           // Connection accepted by the listening thread
+    STAGE_READ,             // Thread started, request line and headers read
+    STAGE_RESOLVE,          // Manifest lookup, open/fstat/realpath done
+    STAGE_DIRLIST,          // Directory listing or archive layout built
+    STAGE_SEND,             // Body sent or handed to the streaming engine
+    STAGE_DONE,
+    STAGE_COUNT
+} request_stage;
+
+typedef struct {
+    uint64_t t[STAGE_COUNT]; // Monotonic ns, 0 for stages the request skipped
+    time_t when;
+    struct sockaddr_in client;
+    int status;
+    off_t bytes;
+    char path[128];
+} flight_record;
+
+// Handed from the accept loop to the connection thread
+typedef struct {
+    int fd;
+    uint64_t accepted;       // STAGE_ACCEPT stamp, 0 with the recorder off
+} connection_job;
+
+// Static tracepoints for perf/bpftrace (make USDT=1, needs <sys/sdt.h>).
+// Without USDT they compile to nothing.
+#if defined(CW_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CW_PROBE1(name, a) DTRACE_PROBE1(cwserver, name, a)
+#define CW_PROBE2(name, a, b) DTRACE_PROBE2(cwserver, name, a, b)
+#define CW_PROBE4(name, a, b, c, d) DTRACE_PROBE4(cwserver, name, a, b, c, d)
+#endif
+#endif
+#ifndef CW_PROBE1
+#define CW_PROBE1(name, a) do { } while (0)
+#define CW_PROBE2(name, a, b) do { } while (0)
+#define CW_PROBE4(name, a, b, c, d) do { } while (0)
+#endif
+
+// Uploads in the protected view (-u max_bytes)
+#ifndef UPLOAD_IO_TIMEOUT
+#define UPLOAD_IO_TIMEOUT 60        // Seconds without body data before an upload is dropped
+#endif
+#ifndef UPLOAD_LINGER_TIME
+#define UPLOAD_LINGER_TIME 2        // Seconds spent discarding the body of a rejected upload
+#endif
+#ifndef UPLOAD_LINGER_MAX
+#define UPLOAD_LINGER_MAX (16 * 1024 * 1024)
+#endif
+#ifndef UPLOAD_PART_MAX_AGE
+#define UPLOAD_PART_MAX_AGE (24 * 3600) // Seconds an unfinished resumable upload is kept
+#endif
+
+// Filename search index (-s)
+#ifndef SEARCH_WALK_THREADS
+#define SEARCH_WALK_THREADS 4
+#endif
+#ifndef SEARCH_BATCH
+#define SEARCH_BATCH (64 * 1024)    // Walker buffer, inserted under one lock
+#endif
+#ifndef SEARCH_MAX_QUERY
+#define SEARCH_MAX_QUERY 64         // Trigrams used from one query
+#endif
+#ifndef SEARCH_DEFAULT_LIMIT
+#define SEARCH_DEFAULT_LIMIT 100
+#endif
+#ifndef SEARCH_MAX_LIMIT
+#define SEARCH_MAX_LIMIT 1000
+#endif
+#ifndef SEARCH_COMPACT_MIN
+#define SEARCH_COMPACT_MIN 65536    // Rebuild once this many removed entries outnumber live ones
+#endif
+
+#define SEARCH_DIR     0x01
+#define SEARCH_DELETED 0x02
+
+typedef struct {
+    uint32_t path_off;      // Path relative to the web root, in the arena
+    uint16_t path_len;
+    uint16_t base_off;      // Start of the basename within the path
+    uint32_t hnext;         // Next id in the same path hash bucket
+    uint32_t flags;         // SEARCH_*
+    uint32_t parent;        // Directory holding it, 0 (the root) at the top level
+    uint32_t child;         // Newest entry directly inside, for directories
+    uint32_t sibling;       // Next older entry in the same directory
+    uint32_t below;         // Entries ever added below it, bounds a subtree walk
+} search_entry;
+
+typedef struct {
+    uint32_t key;           // Lower-cased trigram + 1, 0 marks a free slot
+    uint32_t count, cap;
+    uint32_t *ids;          // Ascending
+} search_posting;
+
+typedef struct {
+    search_entry *entries;  // Indexed by id, id 0 stands for the web root
+    uint32_t count, cap;
+    char *arena;
+    size_t arena_len, arena_cap;
+    uint32_t *buckets;      // Path hash -> first id
+    uint32_t nbuckets;
+    search_posting *grams;  // Open addressing on key
+    uint32_t grams_cap, grams_used;
+    uint32_t live, deleted;
+} search_index;
+
+// Reverse proxy (-P prefix=upstream[,upstream...]). Requests under a
+// prefix are forwarded to one of its upstreams; idle keep-alive connections
+// are pooled per upstream. Upstreams that keep failing are skipped for
+// PROXY_RETRY_AFTER seconds, then probed again by live traffic.
+#ifndef PROXY_MAX_ROUTES
+#define PROXY_MAX_ROUTES 8
+#endif
+#ifndef PROXY_MAX_UPSTREAMS
+#define PROXY_MAX_UPSTREAMS 4     // Per route
+#endif
+#ifndef PROXY_POOL_SIZE
+#define PROXY_POOL_SIZE 8         // Idle connections kept per upstream
+#endif
+#ifndef PROXY_CONNECT_TIMEOUT
+#define PROXY_CONNECT_TIMEOUT 2000 // ms
+#endif
+#ifndef PROXY_IO_TIMEOUT
+#define PROXY_IO_TIMEOUT 30       // Seconds without progress on either side
+#endif
+#ifndef PROXY_FAIL_THRESHOLD
+#define PROXY_FAIL_THRESHOLD 3    // Consecutive failures before an upstream is marked down
+#endif
+#ifndef PROXY_RETRY_AFTER
+#define PROXY_RETRY_AFTER 10      // Seconds a down upstream is skipped
+#endif
+#ifndef SPLICE_CHUNK
+#define SPLICE_CHUNK (64 * 1024)
+#endif
+
+typedef struct {
+    char name[128];         // As configured, used in logs and as default Host
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    pthread_mutex_t lock;
+    int idle[PROXY_POOL_SIZE];
+    int idle_count;
+    int fails;              // Consecutive failures
+    time_t down_until;
+} proxy_upstream;
+
+typedef struct {
+    char prefix[256];       // Normalized path prefix, no leading or trailing '/'
+    size_t prefix_len;
+    proxy_upstream upstreams[PROXY_MAX_UPSTREAMS];
+    int count;
+    unsigned next;          // Round-robin cursor
+} proxy_route;
+
 typedef struct {
     const char *extension;
     const char *mime_type;
@@ -56,12 +547,19 @@ char pftp_path_prefix[MAXLINE] = "";
 char ftp_password[MAXLINE] = "";
 
 void client_error(int fd, int status, const char *msg, const char *longmsg);
-void handle_directory_request(int out_fd, const char *dirname, const char *icon_style);
+void handle_directory_request(int out_fd, const char *dirname, const char *icon_style, const char *query, bool http10);
+bool get_query_param(const char *query, const char *key, char *out, size_t outsz);
+void chunked_init(chunked_t *cw, int fd, bool framed);
+void chunked_printf(chunked_t *cw, const char *fmt, ...);
+void chunked_flush(chunked_t *cw);
+void chunked_end(chunked_t *cw);
 static const char* get_mime_type(const char *filename);
+static int get_mime_index(const char *filename);
 static const char* get_file_icon(const char *filename, const char *icon_style);
 int open_listenfd(const char *port);
 void url_decode(const char *src, char *dest, int max);
-void parse_request(int fd, http_request *req);
+int parse_uri(const char *uri, char *path, size_t pathsz, char *query, size_t querysz);
+bool parse_request(int fd, http_request *req);
 void log_message(const char *fmt, ...);
 void log_error(const char *fmt, ...);
 void log_access(int status, struct sockaddr_in *c_addr, http_request *req);
@@ -70,8 +568,39 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n);
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 void format_size(char *buf, off_t size);
 void serve_static(int out_fd, const char *filename, http_request *req, size_t total_size, bool is_ftp_mode);
+off_t send_file_range(int out_fd, int in_fd, off_t offset, off_t end);
+int resolve_range(int fd, http_request *req, off_t total);
+int serve_archive(int out_fd, const char *dirname, http_request *req, const char *format);
+bool path_is_allowed(const char *resolved_path);
+int tree_watch_init(void);
+int tree_watch_start(void);
+void tree_watch_listen(tree_watch_fn fn);
+int tree_watch_add(const char *dir);
+void tree_watch_add_tree(const char *dir, bool notify);
+uint64_t manifest_etag(const struct stat *st);
+void manifest_fill(const char *path, const struct stat *st, manifest_entry *me);
+int manifest_open(const char *file);
+void manifest_watch_start(void);
+int manifest_lookup(const char *path, manifest_entry *out);
+int serve_manifest_file(int out_fd, http_request *req, const manifest_entry *me);
+int stream_engine_start(void);
+bool stream_submit(int out_fd, int in_fd, off_t offset, off_t end, off_t file_size);
+void flight_begin(const struct sockaddr_in *clientaddr, uint64_t accepted);
+void flight_stage(request_stage stage);
+void flight_add_bytes(off_t n);
+void flight_finish(void);
+void flight_dump(FILE *out);
+int flight_recorder_start(void);
+void thread_attr_init(void);
+int search_start(void);
+int serve_search(int out_fd, const char *dirname, const char *icon_style, const char *query, const char *needle, bool http10);
+off_t splice_body(rio_t *rp, int dst, loff_t *dst_off, off_t n, int pipefd[2]);
+int serve_upload(int fd, http_request *req);
+int proxy_add_route(const char *spec);
+proxy_route *proxy_match(const char *path);
+int proxy_request(int fd, struct sockaddr_in *clientaddr, http_request *req, proxy_route *route);
 void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style);
-void *connection_handler(void *socket_desc);
+void *connection_handler(void *arg);
 void daemonize_process();
 void usage(char *program_name);
 void print_version();
@@ -107,6 +636,42 @@ static const mime_map meme_types[] = {
     {NULL, NULL},
 };
 
+#define MIME_TYPES_COUNT (sizeof(meme_types) / sizeof(meme_types[0]) - 1)
+
+static pthread_attr_t *thread_attr = NULL; // CW_THREAD_STACK, NULL: system default
+static int connections_active = 0;        // Threads and streaming jobs, checked against CW_MAX_CONNECTIONS
+static __thread bool connection_slot_moved; // stream_submit took this connection thread's slot
+
+static stream_engine stream_engines[STREAM_ENGINE_THREADS];
+static int stream_engines_running = 0;
+static long stream_page_size = 4096;
+static pthread_mutex_t stream_drop_lock = PTHREAD_MUTEX_INITIALIZER;
+static stream_job *stream_drop_jobs = NULL; // drop_behind jobs of all engines
+static unsigned stream_next_engine = 0;
+
+static manifest_t manifest;
+
+static long long upload_max = 0; // -u, 0: uploads disabled
+
+static bool search_enabled = false;
+static search_index *search_live = NULL;   // Answers queries
+static search_index *search_shadow = NULL; // Being rebuilt, receives changes too
+static pthread_rwlock_t search_lock = PTHREAD_RWLOCK_INITIALIZER;
+static volatile bool search_rebuilding = false;
+
+static proxy_route proxy_routes[PROXY_MAX_ROUTES];
+static int proxy_route_count = 0;
+
+static uint64_t flight_threshold_ns = 0; // 0: recorder off
+static FILE *flight_log = NULL;          // -L slow log, NULL: ring only
+static pthread_mutex_t flight_lock = PTHREAD_MUTEX_INITIALIZER;
+static flight_record flight_ring[FLIGHT_RING_SIZE];
+static unsigned long flight_ring_next = 0;
+static __thread flight_record flight_current;
+static const char *flight_stage_names[STAGE_COUNT] = {
+    "accept", "read", "resolve", "dirlist", "send", "done"
+};
+
 static const char *default_mime_type = "text/plain";
 const char *default_icon_style = "text";
 char icon_style_str[MAXLINE];
@@ -126,7 +691,7 @@ void log_message(const char *fmt, ...) {
     va_end(ap);
 }
 
-void log_error(const char *fmt, ...) {
+CW_COLD void log_error(const char *fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
     fprintf(stderr, "ERROR: ");
@@ -135,8 +700,157 @@ void log_error(const char *fmt, ...) {
 }
 
 void log_access(int status, struct sockaddr_in *c_addr, http_request *req) {
+    size_t len = strlen(req->filename);
+
     log_message("%s:%d %d - %s\n", inet_ntoa(c_addr->sin_addr),
                 ntohs(c_addr->sin_port), status, req->filename);
+    flight_current.status = status;
+    if (len < sizeof(flight_current.path)) {
+        memcpy(flight_current.path, req->filename, len + 1);
+    } else { // Keep the head of a long path and mark the cut
+        len = sizeof(flight_current.path) - 4;
+        memcpy(flight_current.path, req->filename, len);
+        memcpy(flight_current.path + len, "...", 4);
+    }
+}
+
+static inline uint64_t flight_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// accepted is the flight_now() stamp taken by the accept loop, so the time
+// spent waiting for a thread counts towards the read stage
+void flight_begin(const struct sockaddr_in *clientaddr, uint64_t accepted) {
+    memset(&flight_current, 0, sizeof(flight_current));
+    flight_current.client = *clientaddr;
+    if (flight_threshold_ns)
+        flight_current.t[STAGE_ACCEPT] = accepted ? accepted : flight_now();
+}
+
+// Stamps the end of a stage; a later call for the same stage moves it forward
+void flight_stage(request_stage stage) {
+    if (flight_threshold_ns)
+        flight_current.t[stage] = flight_now();
+    CW_PROBE1(request__stage, stage);
+}
+
+void flight_add_bytes(off_t n) {
+    if (n > 0)
+        flight_current.bytes += n;
+}
+
+// One line per request: total, client, status, bytes, then the time spent
+// in every stage the request went through
+static void flight_format(const flight_record *r, char *buf, size_t size) {
+    char when[32];
+    struct tm tm_buf;
+    size_t len, room = size - 1; // The newline fits even when the line is cut short
+    int n;
+    uint64_t prev = r->t[STAGE_ACCEPT];
+
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime_r(&r->when, &tm_buf));
+    n = snprintf(buf, room, "%s SLOW %.3fms %s:%d %d bytes=%lld path=%s", when,
+                   (r->t[STAGE_DONE] - r->t[STAGE_ACCEPT]) / 1e6, inet_ntoa(r->client.sin_addr),
+                   ntohs(r->client.sin_port), r->status, (long long)r->bytes,
+                   r->path[0] ? r->path : "-");
+    len = n < 0 ? 0 : (size_t)n;
+    for (int s = STAGE_READ; s < STAGE_DONE && len < room; s++) {
+        if (!r->t[s])
+            continue;
+        n = snprintf(buf + len, room - len, " %s=%.3fms", flight_stage_names[s], (r->t[s] - prev) / 1e6);
+        len += n < 0 ? 0 : (size_t)n;
+        prev = r->t[s];
+    }
+    if (len >= room) // Truncated: snprintf kept room - 1 bytes
+        len = room - 1;
+    buf[len] = '\n';
+    buf[len + 1] = '\0';
+}
+
+void flight_finish(void) {
+    flight_record *r = &flight_current;
+    char line[512];
+
+    if (flight_threshold_ns)
+        r->t[STAGE_DONE] = flight_now();
+    CW_PROBE4(request__done, r->status, (long long)r->bytes,
+              r->t[STAGE_DONE] - r->t[STAGE_ACCEPT], r->path);
+    if (!flight_threshold_ns || r->t[STAGE_DONE] - r->t[STAGE_ACCEPT] < flight_threshold_ns)
+        return;
+
+    r->when = time(NULL);
+    if (flight_log)
+        flight_format(r, line, sizeof(line));
+    pthread_mutex_lock(&flight_lock);
+    flight_ring[flight_ring_next++ % FLIGHT_RING_SIZE] = *r;
+    if (flight_log) {
+        fputs(line, flight_log);
+        fflush(flight_log);
+    }
+    pthread_mutex_unlock(&flight_lock);
+}
+
+// Oldest first; the ring keeps the last FLIGHT_RING_SIZE slow requests
+CW_COLD void flight_dump(FILE *out) {
+    char line[512];
+    unsigned long first, next;
+
+    pthread_mutex_lock(&flight_lock);
+    next = flight_ring_next;
+    first = next > FLIGHT_RING_SIZE ? next - FLIGHT_RING_SIZE : 0;
+    fprintf(out, "--- %lu slow request(s) over %.3fms, showing last %lu ---\n",
+            next, flight_threshold_ns / 1e6, next - first);
+    for (unsigned long i = first; i < next; i++) {
+        flight_format(&flight_ring[i % FLIGHT_RING_SIZE], line, sizeof(line));
+        fputs(line, out);
+    }
+    fflush(out);
+    pthread_mutex_unlock(&flight_lock);
+}
+
+static void *flight_signal_thread(void *arg) {
+    sigset_t *set = arg;
+    int sig;
+
+    for (;;) {
+        if (sigwait(set, &sig) == 0 && sig == SIGUSR1)
+            flight_dump(flight_log ? flight_log : stderr);
+    }
+    return NULL;
+}
+
+// Connection, streaming and dump threads get CW_THREAD_STACK bytes of stack.
+// Startup and rebuild threads walk directory trees and keep the default.
+void thread_attr_init(void) {
+    static pthread_attr_t attr;
+    size_t size = CW_THREAD_STACK;
+
+    if (size < PTHREAD_STACK_MIN)
+        size = PTHREAD_STACK_MIN;
+    if (pthread_attr_init(&attr) != 0 || pthread_attr_setstacksize(&attr, size) != 0) {
+        log_error("Cannot set the thread stack size, using the default\n");
+        return;
+    }
+    thread_attr = &attr;
+}
+
+// Must run before any other thread is created so they all inherit the
+// blocked SIGUSR1 and only the dump thread receives it
+int flight_recorder_start(void) {
+    static sigset_t set;
+    pthread_t tid;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (pthread_sigmask(SIG_BLOCK, &set, NULL) != 0 ||
+        pthread_create(&tid, thread_attr, flight_signal_thread, &set) != 0) {
+        log_error("Cannot start the SIGUSR1 dump thread\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
 }
 
 void rio_readinitb(rio_t *rp, int fd) {
@@ -145,7 +859,7 @@ void rio_readinitb(rio_t *rp, int fd) {
     rp->rio_bufptr = rp->rio_buf;
 }
 
-ssize_t writen(int fd, const void *usrbuf, size_t n) {
+CW_HOT ssize_t writen(int fd, const void *usrbuf, size_t n) {
     size_t nleft = n;
     ssize_t nwritten;
     const char *bufp = usrbuf;
@@ -163,12 +877,13 @@ ssize_t writen(int fd, const void *usrbuf, size_t n) {
     return n;
 }
 
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+static CW_HOT ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     int cnt;
     while (rp->rio_cnt <= 0) {
         rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
         if (rp->rio_cnt < 0) {
-            if (errno == EINTR)
+            rp->rio_cnt = 0;
+            if (errno != EINTR) // Includes EAGAIN from SO_RCVTIMEO
                 return -1;
         } else if (rp->rio_cnt == 0)
             return 0;
@@ -185,7 +900,7 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
     return cnt;
 }
 
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+CW_HOT ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
     int n, rc;
     char c, *bufp = usrbuf;
 
@@ -218,175 +933,474 @@ void format_size(char *buf, off_t size) {
     }
 }
 
-void handle_directory_request(int out_fd, const char *dirname, const char *icon_style) {
-    char buf[MAXLINE], m_time[32], size[16];
-    struct stat statbuf;
+void chunked_init(chunked_t *cw, int fd, bool framed) {
+    cw->fd = fd;
+    cw->len = 0;
+    cw->failed = false;
+    cw->framed = framed;
+}
 
-    printf("handle_directory_request: ENTERED, dirname='%s', icon_style='%s'\n", dirname, icon_style);
-    printf("handle_directory_request: dirname = '%s', icon_style = '%s'\n", dirname, icon_style);
+// Response head of a generated page. HTTP/1.0 clients do not understand
+// chunked encoding and get a body that ends when the connection closes.
+static void send_page_head(int fd, const char *content_type, bool http10) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\n%s\r\nCache-Control: no-cache\r\n\r\n",
+             content_type, http10 ? "Connection: close" : "Transfer-Encoding: chunked");
+    writen(fd, buf, strlen(buf));
+}
 
-    snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: text/html; charset=utf-8\r\n\r\n");
-    printf("handle_directory_request: writing HTTP header\n");
-    writen(out_fd, buf, strlen(buf));
-    printf("handle_directory_request: HTTP header written\n");
-
-    snprintf(buf, sizeof(buf),
-             "<html><head><title>Directory listing for %s</title><style>"
-             "body{font-family: monospace; font-size: 13px;}"
-             "td {padding: 1.5px 6px;}"
-             "</style></head><body><h1>Directory listing for %s</h1><hr><table>\n",
-             dirname, dirname);
-    printf("handle_directory_request: writing HTML header\n");
-    writen(out_fd, buf, strlen(buf));
-    printf("handle_directory_request: HTML header written\n");
+void chunked_flush(chunked_t *cw) {
+    char hdr[CHUNK_PREFIX];
+    int hlen;
+    char *start;
 
-    printf("handle_directory_request: opening directory '%s'\n", dirname);
-    DIR *d = opendir(dirname);
-    if (!d) {
-        int errsv = errno;
-        log_error("opendir(%s) failed: %s\n", dirname, strerror(errsv));
-        client_error(out_fd, 500, "Internal Server Error", "Failed to open directory");
+    if (cw->len == 0 || cw->failed)
+        return;
+    if (!cw->framed) {
+        if (writen(cw->fd, cw->buf + CHUNK_PREFIX, cw->len) < 0)
+            cw->failed = true;
+        else
+            flight_add_bytes(cw->len);
+        cw->len = 0;
         return;
     }
-    printf("handle_directory_request: directory '%s' opened successfully\n", dirname);
-
-    struct dirent *dp;
-    printf("handle_directory_request: starting readdir loop\n");
-    while ((dp = readdir(d)) != NULL) {
-        printf("handle_directory_request: readdir returned entry '%s'\n", dp->d_name);
-        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..")) {
-            printf("handle_directory_request: skipping '.' or '..'\n");
-            continue;
-        }
 
-        char full_path[PATH_MAX];
-        snprintf(full_path, sizeof(full_path), "%s/%s", dirname, dp->d_name);
-        printf("handle_directory_request: full_path = '%s'\n", full_path);
+    hlen = snprintf(hdr, sizeof(hdr), "%zx\r\n", cw->len);
+    start = cw->buf + CHUNK_PREFIX - hlen; // Chunk-size line goes right before the data
+    memcpy(start, hdr, hlen);
+    memcpy(cw->buf + CHUNK_PREFIX + cw->len, "\r\n", 2);
+    if (writen(cw->fd, start, hlen + cw->len + 2) < 0)
+        cw->failed = true;
+    else
+        flight_add_bytes(hlen + cw->len + 2);
+    cw->len = 0;
+}
 
-        printf("handle_directory_request: calling stat('%s')\n", full_path);
-        if (stat(full_path, &statbuf) == -1) {
-            int errsv = errno;
-            log_error("stat(%s) failed: %s\n", full_path, strerror(errsv));
-            continue;
+void chunked_printf(chunked_t *cw, const char *fmt, ...) {
+    va_list ap;
+    int n;
+
+    while (!cw->failed) {
+        size_t room = CHUNK_BUFSIZE - cw->len;
+        va_start(ap, fmt);
+        n = vsnprintf(cw->buf + CHUNK_PREFIX + cw->len, room, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t)n < room) {
+            cw->len += n;
+            return;
+        }
+        if (cw->len == 0) { // Record is larger than the whole buffer - send it truncated
+            cw->len = room - 1;
+            return;
         }
-        printf("handle_directory_request: stat('%s') successful\n", full_path);
+        chunked_flush(cw);
+    }
+}
 
-        printf("handle_directory_request: statbuf.st_mtime = %ld\n", (long)statbuf.st_mtime); // **ДОБАВЛЕНО DEBUG LOG**
-        strftime(m_time, sizeof(m_time), "%Y-%m-%d %H:%M", localtime(&statbuf.st_mtime));
-        format_size(size, statbuf.st_size);
+void chunked_end(chunked_t *cw) {
+    chunked_flush(cw);
+    if (cw->framed && !cw->failed && writen(cw->fd, "0\r\n\r\n", 5) < 0)
+        cw->failed = true;
+}
 
-        char *display_name = dp->d_name;
-        printf("handle_directory_request: display_name = '%s'\n", display_name);
+bool get_query_param(const char *query, const char *key, char *out, size_t outsz) {
+    size_t klen = strlen(key);
+    const char *p = query;
+
+    while (p != NULL && *p != '\0') {
+        const char *amp = strchr(p, '&');
+        size_t plen = amp ? (size_t)(amp - p) : strlen(p);
+
+        if (plen >= klen && strncmp(p, key, klen) == 0 && (plen == klen || p[klen] == '=')) {
+            char raw[MAXLINE];
+            size_t vlen = plen > klen ? plen - klen - 1 : 0;
+            if (vlen >= sizeof(raw))
+                vlen = sizeof(raw) - 1;
+            memcpy(raw, p + plen - vlen, vlen);
+            raw[vlen] = '\0';
+            url_decode(raw, out, outsz);
+            return true;
+        }
+        p = amp ? amp + 1 : NULL;
+    }
+    return false;
+}
 
-        char *dir_indicator = (S_ISDIR(statbuf.st_mode)) ? "/" : "";
-        printf("handle_directory_request: dir_indicator = '%s'\n", dir_indicator);
+static void html_escape(const char *src, char *dest, size_t max) {
+    size_t j = 0;
+    for (; *src != '\0'; src++) {
+        const char *rep = NULL;
+        switch (*src) {
+        case '&': rep = "&amp;"; break;
+        case '<': rep = "&lt;"; break;
+        case '>': rep = "&gt;"; break;
+        case '"': rep = "&quot;"; break;
+        }
+        size_t len = rep ? strlen(rep) : 1;
+        if (j + len >= max)
+            break;
+        if (rep) {
+            memcpy(dest + j, rep, len);
+        } else {
+            dest[j] = *src;
+        }
+        j += len;
+    }
+    dest[j] = '\0';
+}
 
-        printf("handle_directory_request: icon_style перед выбором иконки = '%s'\n", icon_style); // **Debug: icon_style перед выбором иконки**
-        const char *icon = S_ISDIR(statbuf.st_mode) ?
-            (strcmp(icon_style, "emoji") == 0 ? emoji_icons[0] : text_icons[0]) :
-            get_file_icon(dp->d_name, icon_style);
-        printf("handle_directory_request: icon = '%s'\n", icon);
+// Percent-encodes everything but unreserved characters and '/', for hrefs
+static void url_encode(const char *src, char *dest, size_t max) {
+    static const char hex[] = "0123456789ABCDEF";
+    size_t j = 0;
 
-        char escaped_name[MAXLINE];
-        int j = 0;
-        for (int i = 0; display_name[i] != '\0' && j < MAXLINE - 1; i++) {
-          escaped_name[j++] = display_name[i];
+    for (; *src && j + 4 <= max; src++) {
+        unsigned char c = *src;
+        if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            dest[j++] = c;
+        } else {
+            dest[j++] = '%';
+            dest[j++] = hex[c >> 4];
+            dest[j++] = hex[c & 15];
         }
-        escaped_name[j] = '\0';
-        printf("handle_directory_request: escaped_name = '%s'\n", escaped_name);
-
+    }
+    dest[j] = '\0';
+}
 
-        printf("handle_directory_request: snprintf for table row, icon_style = '%s'\n", icon_style);
-        if (strcmp(icon_style, "none") == 0) {
-            snprintf(buf, sizeof(buf),
-                     "<tr><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\n",
-                     escaped_name, dir_indicator, escaped_name, dir_indicator, m_time, size);
+static void json_escape(const char *src, char *dest, size_t max) {
+    size_t j = 0;
+    for (; *src != '\0'; src++) {
+        unsigned char c = (unsigned char)*src;
+        char esc[8];
+        size_t len;
+        if (c == '"' || c == '\\') {
+            esc[0] = '\\';
+            esc[1] = c;
+            len = 2;
+        } else if (c < 0x20) {
+            len = snprintf(esc, sizeof(esc), "\\u%04x", c);
         } else {
-            snprintf(buf, sizeof(buf),
-                     "<tr><td>%s</td><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\n",
-                     icon, escaped_name, dir_indicator, escaped_name, dir_indicator, m_time, size);
+            esc[0] = c;
+            len = 1;
         }
-        printf("handle_directory_request: table row snprintf complete\n");
-        printf("handle_directory_request: writing table row\n");
-        writen(out_fd, buf, strlen(buf));
-        printf("handle_directory_request: table row written\n");
+        if (j + len >= max)
+            break;
+        memcpy(dest + j, esc, len);
+        j += len;
     }
-    printf("handle_directory_request: readdir loop finished\n");
+    dest[j] = '\0';
+}
 
-    snprintf(buf, sizeof(buf), "</table><hr></body></html>");
-    printf("handle_directory_request: writing HTML footer\n");
-    writen(out_fd, buf, strlen(buf));
-    printf("handle_directory_request: HTML footer written\n");
+static __thread const char *dir_sort_arena; // Names arena of the listing being sorted
 
-    closedir(d);
-    printf("handle_directory_request: directory '%s' closed\n", dirname);
-    printf("handle_directory_request: function finished successfully\n");
+static int dir_cmp_name(const void *a, const void *b) {
+    return strcmp(dir_sort_arena + ((const dir_entry *)a)->name_off, dir_sort_arena + ((const dir_entry *)b)->name_off);
 }
 
+static int dir_cmp_size(const void *a, const void *b) {
+    const dir_entry *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? -1 : 1;
+    return dir_cmp_name(a, b);
+}
 
+static int dir_cmp_mtime(const void *a, const void *b) {
+    const dir_entry *x = a, *y = b;
+    if (x->mtime != y->mtime)
+        return x->mtime < y->mtime ? -1 : 1;
+    return dir_cmp_name(a, b);
+}
 
-static const char* get_mime_type(const char *filename) {
-    const char *dot = strrchr(filename, '.');
-    if (dot) {
-        for (const mime_map *map = meme_types; map->extension != NULL; map++) {
-            if (strcmp(map->extension, dot) == 0) {
-                return map->mime_type;
-            }
-        }
+static bool dir_fill_stat(int dfd, dir_entry *e, const char *name) {
+    struct stat statbuf;
+    if (fstatat(dfd, name, &statbuf, 0) == -1) {
+        log_error("stat(%s) failed: %s\n", name, strerror(errno));
+        return false;
     }
-    return default_mime_type;
+    e->is_dir = S_ISDIR(statbuf.st_mode);
+    e->size = statbuf.st_size;
+    e->mtime = statbuf.st_mtime;
+    e->has_stat = true;
+    return true;
 }
 
-static const char* get_file_icon(const char *filename, const char *icon_style) {
-    printf("get_file_icon: filename = '%s', icon_style = '%s'\n", filename, icon_style); // Debug: filename and icon_style
+static void dir_emit_row(chunked_t *cw, const dir_entry *e, const char *name, const char *icon_style, bool json, bool first) {
+    char escaped_name[MAXLINE], href[MAXLINE];
+    const char *dir_indicator = e->is_dir ? "/" : "";
 
-    const char *dot = strrchr(filename, '.');
-    if (dot == NULL) {
-        return (strcmp(icon_style, "emoji") == 0) ? emoji_icons[9] : text_icons[9];
+    if (json) {
+        json_escape(name, escaped_name, sizeof(escaped_name));
+        chunked_printf(cw, "%s{\"name\":\"%s\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+                       first ? "" : ",", escaped_name, e->is_dir ? "dir" : "file",
+                       (long long)e->size, (long long)e->mtime);
+        return;
     }
 
-    const char *ext = dot + 1;
+    char m_time[32], size[16];
+    struct tm tm_buf;
+    strftime(m_time, sizeof(m_time), "%Y-%m-%d %H:%M", localtime_r(&e->mtime, &tm_buf));
+    format_size(size, e->size);
+    html_escape(name, escaped_name, sizeof(escaped_name));
+    url_encode(name, href, sizeof(href)); // '#', '?' and '%' in names must not end up raw in the link
 
-    if (strcmp(icon_style, "emoji") == 0) {
-        if (strcasecmp(ext, "txt") == 0 || strcasecmp(ext, "log") == 0 || strcasecmp(ext, "conf") == 0 || strcasecmp(ext, "ini") == 0 || strcasecmp(ext, "csv") == 0) return emoji_icons[1];
-        else if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "png") == 0 || strcasecmp(ext, "gif") == 0 || strcasecmp(ext, "ico") == 0 || strcasecmp(ext, "svg") == 0 || strcasecmp(ext, "webp") == 0) return emoji_icons[2];
-        else if (strcasecmp(ext, "mp4") == 0 || strcasecmp(ext, "webm") == 0 || strcasecmp(ext, "ogg") == 0 || strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "flv") == 0 || strcasecmp(ext, "m2v") == 0 || strcasecmp(ext, "ogx") == 0 || strcasecmp(ext, "mkv") == 0 || strcasecmp(ext, "mov") == 0) return emoji_icons[3];
-        else if (strcasecmp(ext, "mp3") == 0 || strcasecmp(ext, "wav") == 0 || strcasecmp(ext, "flac") == 0 || strcasecmp(ext, "aac") == 0) return emoji_icons[4];
-        else if (strcasecmp(ext, "pdf") == 0 || strcasecmp(ext, "djvu") == 0) return emoji_icons[5];
-        else if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0 || strcasecmp(ext, "css") == 0 || strcasecmp(ext, "js") == 0 || strcasecmp(ext, "xml") == 0 || strcasecmp(ext, "json") == 0 || strcasecmp(ext, "c") == 0 || strcasecmp(ext, "cpp") == 0 || strcasecmp(ext, "h") == 0 || strcasecmp(ext, "py") == 0 || strcasecmp(ext, "java") == 0 || strcasecmp(ext, "php") == 0 || strcasecmp(ext, "sh") == 0) return emoji_icons[6];
-        else if (strcasecmp(ext, "zip") == 0 || strcasecmp(ext, "tar") == 0 || strcasecmp(ext, "gz") == 0 || strcasecmp(ext, "bz2") == 0 || strcasecmp(ext, "rar") == 0 || strcasecmp(ext, "7z") == 0) return emoji_icons[7];
-        else if (strcasecmp(ext, "exe") == 0) return emoji_icons[8];
-        else return emoji_icons[9];
+    if (strcmp(icon_style, "none") == 0) {
+        chunked_printf(cw, "<tr><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\n",
+                       href, dir_indicator, escaped_name, dir_indicator, m_time, size);
     } else {
-        if (strcasecmp(ext, "txt") == 0 || strcasecmp(ext, "log") == 0 || strcasecmp(ext, "conf") == 0 || strcasecmp(ext, "ini") == 0 || strcasecmp(ext, "csv") == 0) return text_icons[1];
-        else if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "png") == 0 || strcasecmp(ext, "gif") == 0 || strcasecmp(ext, "ico") == 0 || strcasecmp(ext, "svg") == 0 || strcasecmp(ext, "webp") == 0) return text_icons[2];
-        else if (strcasecmp(ext, "mp4") == 0 || strcasecmp(ext, "webm") == 0 || strcasecmp(ext, "ogg") == 0 || strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "flv") == 0 || strcasecmp(ext, "m2v") == 0 || strcasecmp(ext, "ogx") == 0 || strcasecmp(ext, "mkv") == 0 || strcasecmp(ext, "mov") == 0) return text_icons[3];
-        else if (strcasecmp(ext, "mp3") == 0 || strcasecmp(ext, "wav") == 0 || strcasecmp(ext, "flac") == 0 || strcasecmp(ext, "aac") == 0) return text_icons[4];
-        else if (strcasecmp(ext, "pdf") == 0 || strcasecmp(ext, "djvu") == 0) return text_icons[5];
-        else if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0 || strcasecmp(ext, "css") == 0 || strcasecmp(ext, "js") == 0 || strcasecmp(ext, "xml") == 0 || strcasecmp(ext, "json") == 0 || strcasecmp(ext, "c") == 0 || strcasecmp(ext, "cpp") == 0 || strcasecmp(ext, "h") == 0 || strcasecmp(ext, "py") == 0 || strcasecmp(ext, "java") == 0 || strcasecmp(ext, "php") == 0 || strcasecmp(ext, "sh") == 0) return text_icons[6];
-        else if (strcasecmp(ext, "zip") == 0 || strcasecmp(ext, "tar") == 0 || strcasecmp(ext, "gz") == 0 || strcasecmp(ext, "bz2") == 0 || strcasecmp(ext, "rar") == 0 || strcasecmp(ext, "7z") == 0) return emoji_icons[7];
-        else if (strcasecmp(ext, "exe") == 0) return text_icons[8];
-        else return text_icons[9];
+        const char *icon = e->is_dir ?
+            (strcmp(icon_style, "emoji") == 0 ? emoji_icons[0] : text_icons[0]) :
+            get_file_icon(name, icon_style);
+        chunked_printf(cw, "<tr><td>%s</td><td><a href=\"%s%s\">%s%s</a></td><td>%s</td><td>%s</td></tr>\n",
+                       icon, href, dir_indicator, escaped_name, dir_indicator, m_time, size);
     }
 }
 
-int open_listenfd(const char *port) {
-    struct addrinfo hints, *listp, *p;
-    int listenfd, optval = 1, rc;
+// Query of the page links: the request's parameters except offset and limit,
+// each prefixed with '&' and escaped for an attribute value
+static void dir_page_query(const char *query, char *out, size_t outsz) {
+    char raw[MAXLINE];
+    size_t len = 0;
+
+    for (const char *p = query; *p != '\0'; ) {
+        size_t plen = strcspn(p, "&"), klen = strcspn(p, "=&");
+        bool paging = (klen == 6 && strncmp(p, "offset", 6) == 0) || (klen == 5 && strncmp(p, "limit", 5) == 0);
+        if (plen > 0 && !paging && len + plen + 2 <= sizeof(raw)) {
+            raw[len++] = '&';
+            memcpy(raw + len, p, plen);
+            len += plen;
+        }
+        p += plen + (p[plen] == '&');
+    }
+    raw[len] = '\0';
+    html_escape(raw, out, outsz);
+}
 
-    memset(&hints, 0, sizeof(struct addrinfo));
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
-    hints.ai_protocol = 0;
+// Directory listing: ?sort=name|size|mtime&order=desc&offset=N&limit=N&format=json
+// Unsorted listings are streamed straight from readdir and only the emitted
+// page is stat'ed; sorted listings go through a compact entry array first.
+void handle_directory_request(int out_fd, const char *dirname, const char *icon_style, const char *query, bool http10) {
+    char param[32], escaped_dir[MAXLINE];
+    dir_sort_key sort = SORT_NONE;
+    bool json = false, desc = false;
+    size_t offset = 0, limit = 0, total = 0, emitted = 0;
+    struct dirent *dp;
 
-    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
-        log_error("getaddrinfo error: %s\n", gai_strerror(rc));
-        return -2;
+    printf("handle_directory_request: ENTERED, dirname='%s', icon_style='%s', query='%s'\n", dirname, icon_style, query);
+
+    if (get_query_param(query, "sort", param, sizeof(param))) {
+        if (strcmp(param, "name") == 0) sort = SORT_NAME;
+        else if (strcmp(param, "size") == 0) sort = SORT_SIZE;
+        else if (strcmp(param, "mtime") == 0) sort = SORT_MTIME;
     }
+    if (get_query_param(query, "order", param, sizeof(param)))
+        desc = strcmp(param, "desc") == 0;
+    if (get_query_param(query, "format", param, sizeof(param)))
+        json = strcmp(param, "json") == 0;
+    if (get_query_param(query, "offset", param, sizeof(param)))
+        offset = strtoul(param, NULL, 10);
+    if (get_query_param(query, "limit", param, sizeof(param)))
+        limit = strtoul(param, NULL, 10);
 
-    for (p = listp; p; p = p->ai_next) {
-        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
-            continue;
+    DIR *d = opendir(dirname);
+    if (!d) {
+        int errsv = errno;
+        log_error("opendir(%s) failed: %s\n", dirname, strerror(errsv));
+        client_error(out_fd, 500, "Internal Server Error", "Failed to open directory");
+        return;
+    }
+    int dfd = dirfd(d);
+
+    chunked_t *cw = malloc(sizeof(chunked_t)); // Keep the 16K buffer off the thread stack
+    if (!cw) {
+        closedir(d);
+        client_error(out_fd, 500, "Internal Server Error", "Out of memory");
+        return;
+    }
+
+    send_page_head(out_fd, json ? "application/json; charset=utf-8" : "text/html; charset=utf-8", http10);
+    chunked_init(cw, out_fd, !http10);
+
+    if (json) {
+        json_escape(dirname, escaped_dir, sizeof(escaped_dir));
+        chunked_printf(cw, "{\"path\":\"%s\",\"offset\":%zu,\"entries\":[", escaped_dir, offset);
+    } else {
+        html_escape(dirname, escaped_dir, sizeof(escaped_dir));
+        chunked_printf(cw,
+                       "<html><head><title>Directory listing for %s</title><style>"
+                       "body{font-family: monospace; font-size: 13px;}"
+                       "td {padding: 1.5px 6px;}"
+                       "</style></head><body><h1>Directory listing for %s</h1>",
+                       escaped_dir, escaped_dir);
+        if (search_enabled)
+            chunked_printf(cw, "<form method=\"get\"><input name=\"search\" placeholder=\"Search below this folder\"></form>");
+        chunked_printf(cw, "<hr><table>\n");
+    }
+
+    if (sort == SORT_NONE) {
+        // Readdir order: count everything, stat only the requested page
+        while ((dp = readdir(d)) != NULL && !cw->failed) {
+            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+                continue;
+            size_t idx = total++;
+            if (idx < offset || (limit > 0 && idx - offset >= limit))
+                continue;
+            dir_entry e = { 0 };
+            if (!dir_fill_stat(dfd, &e, dp->d_name))
+                continue;
+            dir_emit_row(cw, &e, dp->d_name, icon_style, json, emitted++ == 0);
+        }
+    } else {
+        dir_entry *entries = NULL;
+        char *names = NULL;
+        size_t cap = 0, names_len = 0, names_cap = 0;
+
+        while ((dp = readdir(d)) != NULL) {
+            if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+                continue;
+            size_t nlen = strlen(dp->d_name) + 1;
+            if (total == cap) {
+                size_t ncap = cap ? cap * 2 : 256;
+                dir_entry *tmp = realloc(entries, ncap * sizeof(dir_entry));
+                if (!tmp) break;
+                entries = tmp;
+                cap = ncap;
+            }
+            if (names_len + nlen > names_cap) {
+                size_t ncap = names_cap ? names_cap * 2 : 8192;
+                while (ncap < names_len + nlen) ncap *= 2;
+                char *tmp = realloc(names, ncap);
+                if (!tmp) break;
+                names = tmp;
+                names_cap = ncap;
+            }
+            dir_entry *e = &entries[total];
+            memset(e, 0, sizeof(*e));
+            e->name_off = names_len;
+            memcpy(names + names_len, dp->d_name, nlen);
+            if (sort != SORT_NAME && !dir_fill_stat(dfd, e, dp->d_name)) // Size/mtime ordering needs stat up front
+                continue;
+            names_len += nlen;
+            total++;
+        }
+        if (dp != NULL)
+            log_error("Directory listing of %s truncated: out of memory\n", dirname);
+
+        dir_sort_arena = names;
+        qsort(entries, total, sizeof(dir_entry),
+              sort == SORT_SIZE ? dir_cmp_size : sort == SORT_MTIME ? dir_cmp_mtime : dir_cmp_name);
+        if (desc) {
+            for (size_t i = 0, j = total; i + 1 < j; i++, j--) {
+                dir_entry tmp = entries[i];
+                entries[i] = entries[j - 1];
+                entries[j - 1] = tmp;
+            }
+        }
+
+        for (size_t i = offset; i < total && (limit == 0 || i - offset < limit) && !cw->failed; i++) {
+            const char *name = names + entries[i].name_off;
+            if (!entries[i].has_stat && !dir_fill_stat(dfd, &entries[i], name))
+                continue;
+            dir_emit_row(cw, &entries[i], name, icon_style, json, emitted++ == 0);
+        }
+
+        free(entries);
+        free(names);
+    }
+
+    if (json) {
+        chunked_printf(cw, "],\"total\":%zu}", total);
+    } else {
+        chunked_printf(cw, "</table><hr>");
+        if (limit > 0) {
+            char extra[MAXLINE];
+            dir_page_query(query, extra, sizeof(extra));
+            if (offset > 0)
+                chunked_printf(cw, "<a href=\"?offset=%zu&amp;limit=%zu%s\">&laquo; prev</a> ",
+                               offset > limit ? offset - limit : 0, limit, extra);
+            if (offset + limit < total)
+                chunked_printf(cw, "<a href=\"?offset=%zu&amp;limit=%zu%s\">next &raquo;</a>",
+                               offset + limit, limit, extra);
+        }
+        chunked_printf(cw, "</body></html>");
+    }
+    chunked_end(cw);
+
+    closedir(d);
+    free(cw);
+    printf("handle_directory_request: %zu entries, %zu sent\n", total, emitted);
+}
+
+
+
+static int get_mime_index(const char *filename) {
+    const char *dot = strrchr(filename, '.');
+    if (dot) {
+        for (const mime_map *map = meme_types; map->extension != NULL; map++) {
+            if (strcmp(map->extension, dot) == 0) {
+                return map - meme_types;
+            }
+        }
+    }
+    return -1;
+}
+
+static const char* get_mime_type(const char *filename) {
+    int index = get_mime_index(filename);
+    return index < 0 ? default_mime_type : meme_types[index].mime_type;
+}
+
+static const char* get_file_icon(const char *filename, const char *icon_style) {
+    printf("get_file_icon: filename = '%s', icon_style = '%s'\n", filename, icon_style); // Debug: filename and icon_style
+
+    const char *dot = strrchr(filename, '.');
+    if (dot == NULL) {
+        return (strcmp(icon_style, "emoji") == 0) ? emoji_icons[9] : text_icons[9];
+    }
+
+    const char *ext = dot + 1;
+
+    if (strcmp(icon_style, "emoji") == 0) {
+        if (strcasecmp(ext, "txt") == 0 || strcasecmp(ext, "log") == 0 || strcasecmp(ext, "conf") == 0 || strcasecmp(ext, "ini") == 0 || strcasecmp(ext, "csv") == 0) return emoji_icons[1];
+        else if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "png") == 0 || strcasecmp(ext, "gif") == 0 || strcasecmp(ext, "ico") == 0 || strcasecmp(ext, "svg") == 0 || strcasecmp(ext, "webp") == 0) return emoji_icons[2];
+        else if (strcasecmp(ext, "mp4") == 0 || strcasecmp(ext, "webm") == 0 || strcasecmp(ext, "ogg") == 0 || strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "flv") == 0 || strcasecmp(ext, "m2v") == 0 || strcasecmp(ext, "ogx") == 0 || strcasecmp(ext, "mkv") == 0 || strcasecmp(ext, "mov") == 0) return emoji_icons[3];
+        else if (strcasecmp(ext, "mp3") == 0 || strcasecmp(ext, "wav") == 0 || strcasecmp(ext, "flac") == 0 || strcasecmp(ext, "aac") == 0) return emoji_icons[4];
+        else if (strcasecmp(ext, "pdf") == 0 || strcasecmp(ext, "djvu") == 0) return emoji_icons[5];
+        else if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0 || strcasecmp(ext, "css") == 0 || strcasecmp(ext, "js") == 0 || strcasecmp(ext, "xml") == 0 || strcasecmp(ext, "json") == 0 || strcasecmp(ext, "c") == 0 || strcasecmp(ext, "cpp") == 0 || strcasecmp(ext, "h") == 0 || strcasecmp(ext, "py") == 0 || strcasecmp(ext, "java") == 0 || strcasecmp(ext, "php") == 0 || strcasecmp(ext, "sh") == 0) return emoji_icons[6];
+        else if (strcasecmp(ext, "zip") == 0 || strcasecmp(ext, "tar") == 0 || strcasecmp(ext, "gz") == 0 || strcasecmp(ext, "bz2") == 0 || strcasecmp(ext, "rar") == 0 || strcasecmp(ext, "7z") == 0) return emoji_icons[7];
+        else if (strcasecmp(ext, "exe") == 0) return emoji_icons[8];
+        else return emoji_icons[9];
+    } else {
+        if (strcasecmp(ext, "txt") == 0 || strcasecmp(ext, "log") == 0 || strcasecmp(ext, "conf") == 0 || strcasecmp(ext, "ini") == 0 || strcasecmp(ext, "csv") == 0) return text_icons[1];
+        else if (strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0 || strcasecmp(ext, "png") == 0 || strcasecmp(ext, "gif") == 0 || strcasecmp(ext, "ico") == 0 || strcasecmp(ext, "svg") == 0 || strcasecmp(ext, "webp") == 0) return text_icons[2];
+        else if (strcasecmp(ext, "mp4") == 0 || strcasecmp(ext, "webm") == 0 || strcasecmp(ext, "ogg") == 0 || strcasecmp(ext, "avi") == 0 || strcasecmp(ext, "flv") == 0 || strcasecmp(ext, "m2v") == 0 || strcasecmp(ext, "ogx") == 0 || strcasecmp(ext, "mkv") == 0 || strcasecmp(ext, "mov") == 0) return text_icons[3];
+        else if (strcasecmp(ext, "mp3") == 0 || strcasecmp(ext, "wav") == 0 || strcasecmp(ext, "flac") == 0 || strcasecmp(ext, "aac") == 0) return text_icons[4];
+        else if (strcasecmp(ext, "pdf") == 0 || strcasecmp(ext, "djvu") == 0) return text_icons[5];
+        else if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0 || strcasecmp(ext, "css") == 0 || strcasecmp(ext, "js") == 0 || strcasecmp(ext, "xml") == 0 || strcasecmp(ext, "json") == 0 || strcasecmp(ext, "c") == 0 || strcasecmp(ext, "cpp") == 0 || strcasecmp(ext, "h") == 0 || strcasecmp(ext, "py") == 0 || strcasecmp(ext, "java") == 0 || strcasecmp(ext, "php") == 0 || strcasecmp(ext, "sh") == 0) return text_icons[6];
+        else if (strcasecmp(ext, "zip") == 0 || strcasecmp(ext, "tar") == 0 || strcasecmp(ext, "gz") == 0 || strcasecmp(ext, "bz2") == 0 || strcasecmp(ext, "rar") == 0 || strcasecmp(ext, "7z") == 0) return emoji_icons[7];
+        else if (strcasecmp(ext, "exe") == 0) return text_icons[8];
+        else return text_icons[9];
+    }
+}
+
+int open_listenfd(const char *port) {
+    struct addrinfo hints, *listp, *p;
+    int listenfd, optval = 1, rc;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG;
+    hints.ai_protocol = 0;
+
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+        log_error("getaddrinfo error: %s\n", gai_strerror(rc));
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
 
         setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
         setsockopt(listenfd, IPPROTO_TCP, TCP_CORK, (const void*)&optval, sizeof(int));
@@ -408,203 +1422,3495 @@ int open_listenfd(const char *port) {
     return listenfd;
 }
 
+// Hex digit value + 1, zero for anything that is not a hex digit
+static const unsigned char hex_value[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5,
+    ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Decodes a query-string value: %XX escapes, and '+' as a space the way
+// HTML forms send it. Paths go through parse_uri, where '+' stays a plus.
 void url_decode(const char *src, char *dest, int max) {
-    const char *p = src;
+    const unsigned char *p = (const unsigned char *)src;
     char *q = dest;
-    int i;
-    char code[3] = {0};
 
     while (*p != '\0' && q < dest + max - 1) {
-        if (*p == '%') {
-            if (strlen(p) < 2) break;
+        if (*p == '+') {
+            *q++ = ' ';
             p++;
-            code[0] = *p++;
-            code[1] = *p++;
-
-            if (!isxdigit(code[0]) || !isxdigit(code[1])) {
+        } else if (*p == '%') {
+            unsigned hi = hex_value[p[1]];
+            unsigned lo = hi ? hex_value[p[2]] : 0;
+            if (!lo) { // Malformed escape, never read past the terminator
                 *q++ = '?';
+                p += hi ? 2 : 1;
                 continue;
             }
+            *q++ = (char)(((hi - 1) << 4) | (lo - 1));
+            p += 3;
+        } else {
+            *q++ = *p++;
+        }
+    }
+    *q = '\0';
+}
 
-            char *endptr;
-            long value = strtol(code, &endptr, 16);
-
-            if (*endptr != '\0') {
-                *q++ = '?';
+// Splits an origin-form request target into a decoded, normalized path and
+// the raw query string in a single pass. Percent escapes go through
+// hex_value, empty and "." segments are dropped, and ".." pops the previous
+// output segment, so encoded dot-segments are normalized too. The path is
+// relative to the web root ("." for the root) and keeps a trailing slash.
+// Returns -1 for control bytes, encoded NULs, bad escapes, ".." above the
+// root and results that do not fit.
+int parse_uri(const char *uri, char *path, size_t pathsz, char *query, size_t querysz) {
+    const unsigned char *p = (const unsigned char *)uri;
+    size_t q = 0, seg = 0;
+
+    if (*p++ != '/' || pathsz < 2)
+        return -1;
+    query[0] = '\0';
+
+    for (;;) {
+        unsigned c = *p;
+        bool end = (c == '\0' || c == '?' || c == '#');
+
+        if (!end) {
+            if (c == '%') {
+                unsigned hi = hex_value[p[1]];
+                unsigned lo = hi ? hex_value[p[2]] : 0;
+                if (!lo)
+                    return -1;
+                c = ((hi - 1) << 4) | (lo - 1);
+                if (c == 0)
+                    return -1;
+                p += 3;
+            } else {
+                p++;
+            }
+            if (c < 0x20 || c == 0x7f)
+                return -1;
+            if (c != '/') {
+                if (q + 2 >= pathsz) // Room for the separator and terminator
+                    return -1;
+                path[q++] = (char)c;
                 continue;
             }
+        }
+
+        // Segment [seg, q) is complete
+        size_t len = q - seg;
+        if (len == 1 && path[seg] == '.') {
+            q = seg;
+        } else if (len == 2 && path[seg] == '.' && path[seg + 1] == '.') {
+            if (seg == 0)
+                return -1;
+            q = seg - 1;
+            while (q > 0 && path[q - 1] != '/')
+                q--;
+        } else if (len > 0 && !end) {
+            path[q++] = '/';
+        }
+        seg = q;
+
+        if (end) {
+            if (c == '?') {
+                size_t n = 0;
+                for (p++; *p != '\0' && *p != '#' && n + 1 < querysz; p++)
+                    query[n++] = *p;
+                query[n] = '\0';
+            }
+            break;
+        }
+    }
+
+    if (q == 0)
+        path[q++] = '.';
+    path[q] = '\0';
+    return 0;
+}
+
+// Range: bytes=first-[last]. Suffix and multi-range requests are ignored
+// and answered with the full body, which RFC 7233 permits.
+static void parse_range_header(const char *value, http_request *req) {
+    // Largest position both offset (off_t) and end (size_t) hold, 32-bit targets included
+    unsigned long long limit = sizeof(off_t) >= 8 ? (unsigned long long)LLONG_MAX : (unsigned long long)LONG_MAX;
+    unsigned long long first, last;
+    char *endp;
+
+    if (limit > (unsigned long long)SIZE_MAX - 1)
+        limit = SIZE_MAX - 1;
+    // A repeated Range header replaces the earlier one instead of mixing with it
+    req->has_range = false;
+    req->offset = 0;
+    req->end = 0;
+
+    while (*value == ' ' || *value == '\t')
+        value++;
+    if (strncasecmp(value, "bytes=", 6) != 0 || !isdigit((unsigned char)value[6]) || strchr(value, ','))
+        return;
+
+    first = strtoull(value + 6, &endp, 10); // Overflow saturates and fails the limit below
+    if (*endp != '-' || first > limit)
+        return;
+    endp++;
+    if (isdigit((unsigned char)*endp)) {
+        last = strtoull(endp, NULL, 10);
+        if (last < first)
+            return;
+        req->end = last >= limit ? 0 : last + 1; // 0: up to the end of the body
+    }
+    req->offset = first;
+    req->has_range = true;
+}
+
+// True if the comma separated header value lists token (parameters such as
+// ";q=0.5" are ignored, an explicit q=0 is treated as absent)
+static bool header_has_token(const char *value, const char *token) {
+    size_t tlen = strlen(token);
+    const char *p = value;
+
+    while (*p) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        const char *end = p;
+        while (*end && *end != ',' && *end != ';' && *end != ' ' && *end != '\r' && *end != '\n')
+            end++;
+        bool match = (size_t)(end - p) == tlen && strncasecmp(p, token, tlen) == 0;
+        while (*end && *end != ',')
+            end++;
+        if (match) {
+            const char *q = strstr(p, "q=");
+            return !(q && q < end && strtod(q + 2, NULL) == 0.0);
+        }
+        p = end;
+        if (*p == '\0' || *p == '\r' || *p == '\n')
+            break;
+    }
+    return false;
+}
+
+// Content-Range: bytes first-last/total, or bytes */total
+static bool parse_content_range(const char *value, http_request *req) {
+    char *endp;
+
+    while (*value == ' ' || *value == '\t')
+        value++;
+    if (strncasecmp(value, "bytes ", 6) != 0)
+        return false;
+    value += 6;
+    if (*value == '*') {
+        req->cr_first = req->cr_last = -1;
+        endp = (char *)value + 1;
+    } else {
+        if (!isdigit((unsigned char)*value))
+            return false;
+        req->cr_first = strtoll(value, &endp, 10);
+        if (*endp != '-' || !isdigit((unsigned char)endp[1]))
+            return false;
+        req->cr_last = strtoll(endp + 1, &endp, 10);
+        if (req->cr_last < req->cr_first)
+            return false;
+    }
+    if (*endp != '/' || !isdigit((unsigned char)endp[1]))
+        return false;
+    req->cr_total = strtoll(endp + 1, NULL, 10);
+    req->has_content_range = true;
+    return true;
+}
+
+// Applies the parsed Range (if any) to a body of total bytes.
+// Returns 200 or 206, or sends 416 itself and returns it.
+int resolve_range(int fd, http_request *req, off_t total) {
+    if (req->end == 0 || req->end > (size_t)total)
+        req->end = total;
+    if (!req->has_range)
+        return 200;
+    if (req->offset >= total) {
+        char buf[MAXLINE];
+        snprintf(buf, sizeof(buf),
+                 "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%lld\r\nContent-Length: 0\r\n\r\n",
+                 (long long)total);
+        writen(fd, buf, strlen(buf));
+        return 416;
+    }
+    return 206;
+}
+
+CW_HOT bool parse_request(int fd, http_request *req) {
+    char buf[MAXLINE], uri[MAXLINE], version[16];
+    req->method[0] = '\0';
+    req->uri[0] = '\0';
+    req->filename[0] = '\0';
+    req->offset = 0;
+    req->end = 0;
+    req->query[0] = '\0';
+    req->has_range = false;
+    req->if_none_match[0] = '\0';
+    req->if_range[0] = '\0';
+    req->accept_gzip = false;
+    req->accept_br = false;
+    req->content_length = -1;
+    req->chunked = false;
+    req->expect_continue = false;
+    req->has_content_range = false;
+    req->headers[0] = '\0';
+    req->headers_len = 0;
+    req->headers_overflow = false;
+    req->http10 = false;
+
+    rio_readinitb(&req->rio, fd);
+
+    ssize_t n;
+    if ((n = rio_readlineb(&req->rio, buf, MAXLINE)) <= 0) {
+        log_error("Failed to read request line\n");
+        return false;
+    }
+    if (strlen(buf) != (size_t)n) { // NUL bytes would silently cut the line short
+        log_error("Rejected request line with a NUL byte\n");
+        return false;
+    }
 
-            *q++ = (char)value;
+    // A method that does not fit is refused, not cut down to one that might
+    const char *method = buf + strspn(buf, " \t");
+    if (strcspn(method, " \t\r\n") >= sizeof(req->method)) {
+        log_error("Rejected over-long request method\n");
+        return false;
+    }
+    int fields = sscanf(buf, "%15s %s %15s", req->method, uri, version);
+    if (fields < 2) {
+        log_error("Failed to parse request line: %s\n", buf);
+        return false;
+    }
+    req->http10 = fields < 3 || strcmp(version, "HTTP/1.0") == 0;
+    snprintf(req->uri, sizeof(req->uri), "%s", uri);
+
+    printf("parse_request: Original URI = '%s'\n", uri); // **ОТЛАДОЧНАЯ ПЕЧАТЬ (перед parse_uri)**
+
+    if (parse_uri(uri, req->filename, sizeof(req->filename), req->query, sizeof(req->query)) < 0) {
+        log_error("Rejected request target: %s\n", uri);
+        snprintf(req->filename, sizeof(req->filename), "-");
+        return false;
+    }
+    printf("parse_request: Decoded filename = '%s'\n", req->filename); // **ОТЛАДОЧНАЯ ПЕЧАТЬ (после parse_uri)**
+
+    // Request headers
+    while ((n = rio_readlineb(&req->rio, buf, MAXLINE)) > 0) {
+        if (strcmp(buf, "\r\n") == 0 || strcmp(buf, "\n") == 0)
+            break;
+        if (strlen(buf) != (size_t)n)
+            return false;
+        if (req->headers_len + n < sizeof(req->headers)) {
+            memcpy(req->headers + req->headers_len, buf, n + 1);
+            req->headers_len += n;
         } else {
-            *q++ = *p++;
+            req->headers_overflow = true;
+        }
+        if (strncasecmp(buf, "Range:", 6) == 0) {
+            parse_range_header(buf + 6, req);
+        } else if (strncasecmp(buf, "If-None-Match:", 14) == 0) {
+            sscanf(buf + 14, " %71[^\r\n]", req->if_none_match);
+        } else if (strncasecmp(buf, "If-Range:", 9) == 0) {
+            sscanf(buf + 9, " %71[^\r\n]", req->if_range);
+        } else if (strncasecmp(buf, "Accept-Encoding:", 16) == 0) {
+            req->accept_gzip = header_has_token(buf + 16, "gzip");
+            req->accept_br = header_has_token(buf + 16, "br");
+        } else if (strncasecmp(buf, "Content-Length:", 15) == 0) {
+            char *endp;
+            req->content_length = strtoll(buf + 15, &endp, 10);
+            if (endp == buf + 15 || req->content_length < 0)
+                return false;
+        } else if (strncasecmp(buf, "Transfer-Encoding:", 18) == 0) {
+            req->chunked = header_has_token(buf + 18, "chunked");
+        } else if (strncasecmp(buf, "Expect:", 7) == 0) {
+            req->expect_continue = header_has_token(buf + 7, "100-continue");
+        } else if (strncasecmp(buf, "Content-Range:", 14) == 0) {
+            if (!parse_content_range(buf + 14, req))
+                return false;
+        }
+    }
+    return true;
+}
+
+
+CW_COLD void client_error(int fd, int status, const char *msg, const char *longmsg) {
+    char buf[MAXLINE];
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", status, msg);
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-length: %lu\r\n", strlen(longmsg));
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-type: text/plain\r\n\r\n");
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%s", longmsg);
+    writen(fd, buf, strlen(buf));
+}
+
+bool is_video_mime_type(const char *mime_type) {
+    return strncmp(mime_type, "video/", 6) == 0;
+}
+
+bool is_audio_mime_type(const char *mime_type) {
+    return strncmp(mime_type, "audio/", 6) == 0;
+}
+
+// Sends [offset, end) of in_fd in bounded sendfile quanta.
+// Returns the number of bytes sent, which is short on error or early EOF.
+off_t send_file_range(int out_fd, int in_fd, off_t offset, off_t end) {
+    off_t start = offset;
+    ssize_t sf_result;
+
+    while (offset < end) {
+        size_t bytes_to_send = end - offset;
+        if (bytes_to_send > STREAM_QUANTUM)
+            bytes_to_send = STREAM_QUANTUM;
+        sf_result = sendfile(out_fd, in_fd, &offset, bytes_to_send);
+
+        if (sf_result < 0 && errno == EINTR)
+            continue;
+        if (sf_result <= 0) {
+            if (sf_result == 0)
+                log_error("sendfile: unexpected end of file at offset %lld\n", (long long)offset);
+            else if (errno == EPIPE || errno == ECONNRESET)
+                log_message("Client disconnected prematurely (Broken pipe)\n");
+            else
+                log_error("sendfile error: %s\n", strerror(errno));
+            break;
+        }
+    }
+    return offset - start;
+}
+
+// Streaming engine for large responses.
+// Connection threads write the headers, then hand the body over to one of
+// the engine threads. Each engine multiplexes its streams with poll() and
+// gives every writable connection at most STREAM_QUANTUM bytes per turn,
+// issuing readahead ahead of the cursor and dropping cache behind it for
+// huge files.
+
+// Limits a drop-behind release of [.., upto) so that pages other streams of
+// the same file have yet to send stay cached: nothing at or past the lowest
+// cursor among them is dropped. Also publishes job's own cursor.
+static off_t stream_drop_limit(stream_job *job, off_t upto) {
+    pthread_mutex_lock(&stream_drop_lock);
+    job->shared_offset = job->offset;
+    for (stream_job *j = stream_drop_jobs; j; j = j->drop_next) {
+        if (j != job && j->dev == job->dev && j->ino == job->ino && j->shared_offset < upto)
+            upto = j->shared_offset;
+    }
+    pthread_mutex_unlock(&stream_drop_lock);
+    return upto;
+}
+
+static void stream_advise(stream_job *job) {
+    // Keep roughly one window of data in flight ahead of the send cursor
+    if (job->ra_next < job->end && job->ra_next - job->offset < STREAM_READAHEAD / 2) {
+        off_t len = job->end - job->ra_next;
+        if (len > STREAM_READAHEAD)
+            len = STREAM_READAHEAD;
+        readahead(job->in_fd, job->ra_next, len);
+        job->ra_next += len;
+    }
+
+    // Huge one-shot files: release pages we have already sent so they do
+    // not push hot small files out of the page cache. A slower stream of the
+    // same file still needs them, so the last one to pass drops them.
+    if (job->drop_behind) {
+        off_t behind = job->offset - STREAM_READAHEAD;
+        if (behind > job->dropped)
+            behind = stream_drop_limit(job, behind);
+        if (behind > job->dropped) {
+            posix_fadvise(job->in_fd, job->dropped, behind - job->dropped, POSIX_FADV_DONTNEED);
+            job->dropped = behind;
+        }
+    }
+}
+
+// How many of the n bytes at the cursor are in the page cache, counted in
+// whole pages from the cursor on. n when mincore cannot tell: for files the
+// server may not write to the kernel reports every page as cached.
+static size_t stream_resident(stream_job *job, size_t n) {
+    unsigned char vec[STREAM_QUANTUM / 4096 + 2];
+    off_t start = job->offset - job->offset % stream_page_size;
+    size_t len = job->offset - start + n;
+    size_t pages = (len + stream_page_size - 1) / stream_page_size, i = 0;
+
+    if (pages > sizeof(vec))
+        return n;
+    void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, job->in_fd, start);
+    if (map == MAP_FAILED)
+        return n;
+    int rc = mincore(map, len, vec);
+    munmap(map, len);
+    if (rc < 0)
+        return n;
+    while (i < pages && (vec[i] & 1))
+        i++;
+    if (i == pages)
+        return n;
+    return i ? (size_t)(start + (off_t)i * stream_page_size - job->offset) : 0;
+}
+
+// Returns false once the job is finished (completed or failed). A stream
+// whose next page is not cached is passed over (cold_since is set) instead of
+// letting sendfile wait for the disk with every other stream of the engine.
+static bool stream_send_quantum(stream_job *job) {
+    size_t n = job->end - job->offset;
+    if (n > STREAM_QUANTUM)
+        n = STREAM_QUANTUM;
+
+    stream_advise(job);
+
+    size_t warm = stream_resident(job, n);
+    if (warm == 0) {
+        uint64_t now = flight_now();
+        if (!job->cold_since) { // Evicted since the readahead, or it never ran: ask again
+            job->cold_since = now;
+            posix_fadvise(job->in_fd, job->offset, n, POSIX_FADV_WILLNEED);
+        }
+        if (now - job->cold_since < STREAM_COLD_WAIT_MS * 1000000ull)
+            return true;
+        // Still not cached (memory pressure, or a file system that reads on
+        // demand only): this one quantum blocks after all
+    } else {
+        n = warm;
+    }
+
+    ssize_t sf_result = sendfile(job->out_fd, job->in_fd, &job->offset, n);
+    if (sf_result > 0) {
+        job->cold_since = 0;
+        job->last_progress = time(NULL);
+        return job->offset < job->end;
+    }
+    if (sf_result < 0 && (errno == EAGAIN || errno == EINTR))
+        return true;
+    if (sf_result == 0) {
+        log_error("sendfile: unexpected end of file at offset %lld\n", (long long)job->offset);
+    } else if (errno == EPIPE || errno == ECONNRESET) {
+        log_message("Client disconnected prematurely (Broken pipe)\n");
+    } else {
+        log_error("sendfile error: %s\n", strerror(errno));
+    }
+    return false;
+}
+
+static void stream_job_close(stream_job *job) {
+    if (job->drop_behind) {
+        off_t upto = stream_drop_limit(job, job->end);
+        if (upto > job->dropped)
+            posix_fadvise(job->in_fd, job->dropped, upto - job->dropped, POSIX_FADV_DONTNEED);
+        pthread_mutex_lock(&stream_drop_lock);
+        for (stream_job **p = &stream_drop_jobs; *p; p = &(*p)->drop_next) {
+            if (*p == job) {
+                *p = job->drop_next;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&stream_drop_lock);
+    }
+    close(job->in_fd);
+    // The slot goes first: a client that sees the close may connect again at once
+    __sync_fetch_and_sub(&connections_active, 1);
+    close(job->out_fd);
+    free(job);
+}
+
+static CW_HOT void *stream_engine_thread(void *arg) {
+    stream_engine *engine = arg;
+    stream_job **jobs = NULL;
+    struct pollfd *pfds = malloc(sizeof(struct pollfd)); // cap jobs + the wakeup pipe
+    size_t njobs = 0, cap = 0, rr = 0;
+
+    if (!pfds) {
+        log_error("stream engine: out of memory\n");
+        return NULL;
+    }
+
+    for (;;) {
+        // Adopt newly submitted streams
+        pthread_mutex_lock(&engine->lock);
+        stream_job *pending = engine->pending;
+        engine->pending = NULL;
+        pthread_mutex_unlock(&engine->lock);
+
+        while (pending) {
+            stream_job *job = pending;
+            pending = pending->next;
+            if (njobs == cap) {
+                size_t ncap = cap ? cap * 2 : 16;
+                stream_job **tj = realloc(jobs, ncap * sizeof(*jobs));
+                struct pollfd *tp = tj ? realloc(pfds, (ncap + 1) * sizeof(*pfds)) : NULL;
+                if (tj) jobs = tj;
+                if (!tp) {
+                    log_error("stream engine: out of memory, dropping stream\n");
+                    stream_job_close(job);
+                    continue;
+                }
+                pfds = tp;
+                cap = ncap;
+            }
+            jobs[njobs++] = job;
+        }
+
+        // Cold streams wait for their readahead, not for the socket, and are
+        // retried every few milliseconds
+        bool cold = false;
+        pfds[0].fd = engine->wake_pipe[0];
+        pfds[0].events = POLLIN;
+        for (size_t i = 0; i < njobs; i++) {
+            pfds[i + 1].fd = jobs[i]->out_fd;
+            pfds[i + 1].events = jobs[i]->cold_since ? 0 : POLLOUT;
+            pfds[i + 1].revents = 0;
+            cold = cold || jobs[i]->cold_since;
+        }
+
+        if (poll(pfds, njobs + 1, cold ? 5 : 1000) < 0 && errno != EINTR) {
+            log_error("stream engine: poll failed: %s\n", strerror(errno));
+            sleep(1);
+            continue;
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            char drain[64];
+            while (read(engine->wake_pipe[0], drain, sizeof(drain)) > 0)
+                ;
         }
+
+        // One bounded quantum per writable connection, starting point rotates
+        time_t now = time(NULL);
+        for (size_t k = 0; k < njobs; k++) {
+            size_t i = (rr + k) % njobs;
+            stream_job *job = jobs[i];
+            bool keep = true;
+
+            if ((pfds[i + 1].revents & (POLLOUT | POLLERR | POLLHUP)) || job->cold_since)
+                keep = stream_send_quantum(job);
+            else if (now - job->last_progress > STREAM_IDLE_TIMEOUT) {
+                log_message("Stream idle for %d seconds, closing\n", STREAM_IDLE_TIMEOUT);
+                keep = false;
+            }
+            if (!keep) {
+                stream_job_close(job);
+                jobs[i] = NULL;
+            }
+        }
+        rr++;
+
+        size_t kept = 0;
+        for (size_t i = 0; i < njobs; i++) {
+            if (jobs[i])
+                jobs[kept++] = jobs[i];
+        }
+        njobs = kept;
+    }
+    return NULL;
+}
+
+int stream_engine_start(void) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page >= 4096)
+        stream_page_size = page;
+
+    for (int i = 0; i < STREAM_ENGINE_THREADS; i++) {
+        stream_engine *engine = &stream_engines[i];
+
+        pthread_mutex_init(&engine->lock, NULL);
+        engine->pending = NULL;
+        if (pipe(engine->wake_pipe) < 0) {
+            log_error("stream engine: pipe failed: %s\n", strerror(errno));
+            return -1;
+        }
+        fcntl(engine->wake_pipe[0], F_SETFL, O_NONBLOCK);
+        fcntl(engine->wake_pipe[1], F_SETFL, O_NONBLOCK);
+
+        pthread_t tid;
+        if (pthread_create(&tid, thread_attr, stream_engine_thread, engine) != 0) {
+            log_error("stream engine: could not create thread\n");
+            return -1;
+        }
+        pthread_detach(tid);
+        stream_engines_running++;
+    }
+    return 0;
+}
+
+// Hands [offset, end) of in_fd over to a streaming engine.
+// On success the engine owns in_fd and a duplicate of out_fd. The job keeps
+// the client connection open, so it takes over the calling connection
+// thread's CW_MAX_CONNECTIONS slot until stream_job_close. Counting both
+// for the moment the thread needs to finish would turn away a client whose
+// connection is already counted.
+bool stream_submit(int out_fd, int in_fd, off_t offset, off_t end, off_t file_size) {
+    struct stat st;
+
+    if (stream_engines_running == 0)
+        return false;
+
+    stream_job *job = calloc(1, sizeof(stream_job));
+    if (!job)
+        return false;
+    job->out_fd = dup(out_fd);
+    if (job->out_fd < 0) {
+        free(job);
+        return false;
+    }
+    // sendfile has no per-call non-blocking flag, so O_NONBLOCK goes on the open
+    // file description, which the dup shares with the connection's socket. That
+    // socket must not be written to after a successful submit: the caller only
+    // logs and closes its descriptor, the engine owns the rest of the response.
+    fcntl(job->out_fd, F_SETFL, fcntl(job->out_fd, F_GETFL) | O_NONBLOCK);
+
+    job->in_fd = in_fd;
+    job->offset = offset;
+    job->end = end;
+    job->dropped = offset;
+    job->drop_behind = file_size >= STREAM_DROP_BEHIND_MIN && fstat(in_fd, &st) == 0;
+    job->last_progress = time(NULL);
+    if (job->drop_behind) {
+        job->dev = st.st_dev;
+        job->ino = st.st_ino;
+        job->shared_offset = offset;
+        pthread_mutex_lock(&stream_drop_lock);
+        job->drop_next = stream_drop_jobs;
+        stream_drop_jobs = job;
+        pthread_mutex_unlock(&stream_drop_lock);
+    }
+    connection_slot_moved = true;
+
+    // Start the first window now so the data is on its way before the engine gets to it
+    job->ra_next = end - offset > STREAM_READAHEAD ? offset + STREAM_READAHEAD : end;
+    posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(in_fd, offset, job->ra_next - offset, POSIX_FADV_WILLNEED);
+
+    stream_engine *engine = &stream_engines[__sync_fetch_and_add(&stream_next_engine, 1) % stream_engines_running];
+    pthread_mutex_lock(&engine->lock);
+    job->next = engine->pending;
+    engine->pending = job;
+    pthread_mutex_unlock(&engine->lock);
+    if (write(engine->wake_pipe[1], "", 1) < 0 && errno != EAGAIN)
+        log_error("stream engine: wakeup failed: %s\n", strerror(errno));
+    return true;
+}
+
+// Обслуговування статичного файлу
+CW_HOT void serve_static(int out_fd, const char *filename, http_request *req, size_t total_size, bool is_ftp_mode) { // is_ftp_mode is present for consistency
+    char buf[MAXLINE];
+    int in_fd;
+    const char *mime_type;
+
+    char resolved_path[PATH_MAX];
+    if (realpath(filename, resolved_path) == NULL) { // Розв'язання відносного шляху в абсолютний
+        client_error(out_fd, 403, "Forbidden", "Invalid path"); // Помилка: недійсний шлях
+        return;
+    }
+
+    if (!path_is_allowed(resolved_path)) { // Перевірка, чи шлях не виходить за межі /tmp (безпека)
+        client_error(out_fd, 403, "Forbidden", "Access denied"); // Помилка доступу: шлях за межами /tmp
+        return;
+    }
+
+    in_fd = open(filename, O_RDONLY, 0); // Відкриття файлу для читання
+    if (in_fd < 0) {
+        client_error(out_fd, 404, "Not found", "File not found"); // Помилка: файл не знайдено
+        return;
+    }
+    flight_stage(STAGE_RESOLVE);
+
+    mime_type = get_mime_type(filename); // Get mime type here, as it's needed in both modes - Отримання MIME-типу тут, оскільки він потрібен в обох режимах
+
+    // In this version, is_ftp_mode is not actually used in serve_static
+    if (is_ftp_mode) { // This block is present but doesn't change behavior in this version
+        if (is_video_mime_type(mime_type)) {
+            snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n");
+            writen(out_fd, buf, strlen(buf));
+
+            char video_html[MAXLINE * 4];
+            snprintf(video_html, sizeof(video_html),
+                     "<!DOCTYPE html><html><head><title>Video Player</title><style>"
+                     "body { font-family: sans-serif; text-align: center; }"
+                     "h1 { font-size: 1.2em; color: #666; }"
+                     "#video-container { display: inline-block; }"
+                     "</style></head><body>"
+                     "<div id=\"video-container\">"
+                     "<h1>Playing: %s</h1>"
+                     "<video width=\"640\" height=\"480\" controls>"
+                     "<source src=\"/%s\" type=\"%s\">"
+                     "Your browser does not support the video tag."
+                     "</video>"
+                     "</div></body></html>",
+                     filename, filename, mime_type);
+
+            writen(out_fd, video_html, strlen(video_html));
+            close(in_fd);
+            return;
+
+        } else {
+            goto serve_file_static;
+        }
+
+
+    } else {
+        goto serve_file_static;
+    }
+
+
+serve_file_static:
+     if (req->has_range) {
+            snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\n");
+            snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Range: bytes %lu-%lu/%lu\r\n",
+                     req->offset, req->end - 1, total_size);
+        } else {
+            snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n");
+        }
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Cache-Control: no-cache\r\n");
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Length: %lu\r\n",
+                 req->end - req->offset);
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Type: %s\r\n\r\n",
+                 mime_type);
+
+        writen(out_fd, buf, strlen(buf));
+
+        if (req->end - req->offset >= STREAM_MIN_SIZE &&
+            stream_submit(out_fd, in_fd, req->offset, req->end, total_size)) {
+            flight_add_bytes(req->end - req->offset);
+            flight_stage(STAGE_SEND); // Hand-off time, the engine keeps sending
+            return; // The streaming engine owns in_fd from here on
+        }
+
+        flight_add_bytes(send_file_range(out_fd, in_fd, req->offset, req->end));
+        flight_stage(STAGE_SEND);
+
+    close(in_fd);
+}
+
+// On-the-fly directory archives for the protected directory view:
+// ?archive=tar (GNU tar) or ?archive=zip (stored, no compression).
+// The tree is walked once to build a compact entry list, which fixes the
+// archive layout and size before anything is sent. Headers are generated
+// in memory while streaming and file bodies go out through sendfile, so
+// any byte range of the archive can be produced without temp files.
+
+static uint32_t crc32_table[256];
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+// Stored zip headers need each file's CRC before its data, so a file is read
+// once for the checksum and once more by sendfile. Checksums are remembered by
+// (dev, ino, size, mtime) so resumed and repeated downloads skip the first read.
+static archive_crc_slot archive_crc_cache[ARCHIVE_CRC_CACHE];
+static pthread_mutex_t archive_crc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void crc32_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc32_table[i] = c;
+    }
+}
+
+static void put16(unsigned char *p, uint32_t v) {
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+}
+
+static void put32(unsigned char *p, uint32_t v) {
+    put16(p, v);
+    put16(p + 2, v >> 16);
+}
+
+static off_t tar_pad(off_t size) {
+    return (512 - (size % 512)) % 512;
+}
+
+static bool archive_add(archive_t *ar, const char *path, const struct stat *st) {
+    size_t len = strlen(path) + 1;
+
+    if (ar->count == ar->cap) {
+        size_t ncap = ar->cap ? ar->cap * 2 : 256;
+        archive_entry *tmp = realloc(ar->entries, ncap * sizeof(archive_entry));
+        if (!tmp) return false;
+        ar->entries = tmp;
+        ar->cap = ncap;
+    }
+    if (ar->names_len + len > ar->names_cap) {
+        size_t ncap = ar->names_cap ? ar->names_cap * 2 : 16384;
+        while (ncap < ar->names_len + len) ncap *= 2;
+        char *tmp = realloc(ar->names, ncap);
+        if (!tmp) return false;
+        ar->names = tmp;
+        ar->names_cap = ncap;
+    }
+
+    archive_entry *e = &ar->entries[ar->count++];
+    memset(e, 0, sizeof(*e));
+    e->path_off = ar->names_len;
+    e->path_len = len - 1;
+    e->is_dir = S_ISDIR(st->st_mode);
+    e->size = e->is_dir ? 0 : st->st_size;
+    e->mtime = st->st_mtime;
+    e->mtime_nsec = st->st_mtim.tv_nsec;
+    e->mode = st->st_mode & 07777;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    memcpy(ar->names + ar->names_len, path, len);
+    ar->names_len += len;
+    return true;
+}
+
+// Collects regular files and directories below root/rel; symlinks and
+// special files are skipped so the archive cannot reach outside the tree.
+// Recursive in connection threads, so the path buffers live on the heap and
+// the depth is capped to keep the thread stack small
+static bool archive_collect(archive_t *ar, const char *rel, int depth) {
+    char *path, *child;
+    struct dirent *dp;
+    struct stat st;
+    bool ok = true;
+
+    if (depth >= ARCHIVE_MAX_DEPTH) {
+        log_error("Archive skips %s: deeper than %d levels\n", rel, ARCHIVE_MAX_DEPTH);
+        return true;
+    }
+    if ((path = malloc(2 * PATH_MAX)) == NULL)
+        return false;
+    child = path + PATH_MAX;
+
+    snprintf(path, PATH_MAX, "%s/%s", ar->root, rel);
+    DIR *d = opendir(path);
+    if (!d) {
+        log_error("opendir(%s) failed: %s\n", path, strerror(errno));
+        free(path);
+        return true;
+    }
+    while (ok && (dp = readdir(d)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d), dp->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode))
+            continue;
+        if ((size_t)snprintf(child, PATH_MAX, "%s%s%s", rel, rel[0] ? "/" : "", dp->d_name) >= PATH_MAX)
+            continue;
+        ok = archive_add(ar, child, &st);
+        if (ok && S_ISDIR(st.st_mode))
+            ok = archive_collect(ar, child, depth + 1);
+    }
+    closedir(d);
+    free(path);
+    return ok;
+}
+
+static const char *archive_path(const archive_t *ar, const archive_entry *e) {
+    return ar->names + e->path_off;
+}
+
+static int archive_cmp_path(const void *a, const void *b) {
+    return strcmp(((const archive_entry *)a)->path, ((const archive_entry *)b)->path);
+}
+
+// Lays out the archive and computes its total size.
+static bool archive_layout(archive_t *ar) {
+    off_t pos = 0, cd_size = 0;
+
+    for (size_t i = 0; i < ar->count; i++) {
+        archive_entry *e = &ar->entries[i];
+        size_t namelen = e->path_len + (e->is_dir ? 1 : 0);
+
+        e->header_off = pos;
+        if (ar->format == ARCHIVE_TAR) {
+            if (namelen > 100) // GNU long name record
+                pos += 512 + namelen + 1 + tar_pad(namelen + 1);
+            pos += 512 + e->size + tar_pad(e->size);
+        } else {
+            pos += 30 + namelen + e->size;
+            cd_size += 46 + namelen;
+        }
+    }
+
+    if (ar->format == ARCHIVE_TAR) {
+        ar->total_size = pos + 1024;
+        return true;
+    }
+
+    // Stored zip without zip64: everything has to fit the 32-bit fields
+    ar->cd_off = pos;
+    ar->total_size = pos + cd_size + 22;
+    return ar->count <= 0xFFFF && ar->total_size <= 0xFFFFFFFFLL;
+}
+
+static uint64_t archive_hash(uint64_t h, const void *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        h ^= ((const unsigned char *)data)[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// Strong validator for the laid out archive: FNV-1a over the format and
+// every entry's path, inode, size and mtime. Any change to the tree that
+// would move a byte of the archive changes it.
+static uint64_t archive_etag(const archive_t *ar) {
+    uint64_t h = archive_hash(1469598103934665603ULL, &ar->format, sizeof(ar->format));
+
+    for (size_t i = 0; i < ar->count; i++) {
+        const archive_entry *e = &ar->entries[i];
+        uint64_t v[5] = { e->ino, e->size, e->mtime, e->mtime_nsec, e->mode | (e->is_dir ? 0x10000 : 0) };
+        h = archive_hash(h, e->path, e->path_len + 1);
+        h = archive_hash(h, v, sizeof(v));
+    }
+    return h;
+}
+
+// True if [pos, pos + len) overlaps the requested window
+static bool archive_wants(const archive_t *ar, off_t len) {
+    return !ar->failed && ar->pos < ar->end && ar->pos + len > ar->start;
+}
+
+static void archive_out_mem(archive_t *ar, const void *data, off_t len) {
+    if (archive_wants(ar, len)) {
+        off_t lo = ar->start > ar->pos ? ar->start - ar->pos : 0;
+        off_t hi = ar->end < ar->pos + len ? ar->end - ar->pos : len;
+        if (writen(ar->out_fd, (const char *)data + lo, hi - lo) < 0)
+            ar->failed = true;
+    }
+    ar->pos += len;
+}
+
+static void archive_out_zeros(archive_t *ar, off_t len) {
+    static const char zeros[1024];
+    while (len > 0) {
+        off_t n = len > (off_t)sizeof(zeros) ? (off_t)sizeof(zeros) : len;
+        archive_out_mem(ar, zeros, n);
+        len -= n;
+    }
+}
+
+// O_NOFOLLOW only covers the last component, so the opened file is checked
+// again: a directory swapped for a symlink after the walk must not lead out of the root
+static int archive_open(const archive_t *ar, const archive_entry *e) {
+    char path[PATH_MAX], real[PATH_MAX];
+    ssize_t n;
+
+    snprintf(path, sizeof(path), "%s/%s", ar->root, archive_path(ar, e));
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return -1;
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    if ((n = readlink(path, real, sizeof(real) - 1)) >= 0) {
+        real[n] = '\0';
+        if (strncmp(real, ar->root, ar->root_len) == 0 && real[ar->root_len] == '/' && path_is_allowed(real))
+            return fd;
+    }
+    close(fd);
+    errno = EACCES;
+    return -1;
+}
+
+static void archive_out_file(archive_t *ar, const archive_entry *e) {
+    off_t sent = 0, lo = 0, hi = 0;
+
+    if (archive_wants(ar, e->size)) {
+        lo = ar->start > ar->pos ? ar->start - ar->pos : 0;
+        hi = ar->end < ar->pos + e->size ? ar->end - ar->pos : e->size;
+        int in_fd = archive_open(ar, e);
+        if (in_fd >= 0) {
+            posix_fadvise(in_fd, lo, hi - lo, POSIX_FADV_SEQUENTIAL);
+            sent = send_file_range(ar->out_fd, in_fd, lo, hi);
+            close(in_fd);
+        } else {
+            log_error("archive: open(%s) failed: %s\n", archive_path(ar, e), strerror(errno));
+        }
+        if (sent < hi - lo) {
+            // File vanished or shrank: the length is already promised, pad with zeros
+            ar->pos += lo + sent;
+            archive_out_zeros(ar, hi - lo - sent);
+            ar->pos += e->size - hi;
+            return;
+        }
+    }
+    ar->pos += e->size;
+}
+
+static void tar_octal(char *field, size_t width, unsigned long long value) {
+    char tmp[32];
+    snprintf(tmp, sizeof(tmp), "%0*llo", (int)(width - 1), value);
+    memcpy(field, tmp, width - 1);
+}
+
+static void tar_header(archive_t *ar, const char *name, size_t namelen, off_t size, time_t mtime, mode_t mode, char type) {
+    unsigned char h[512];
+    unsigned int sum = 0;
+
+    if (!archive_wants(ar, sizeof(h))) {
+        ar->pos += sizeof(h);
+        return;
+    }
+
+    memset(h, 0, sizeof(h));
+    memcpy(h, name, namelen > 100 ? 100 : namelen);
+    tar_octal((char *)h + 100, 8, mode);
+    tar_octal((char *)h + 108, 8, 0);
+    tar_octal((char *)h + 116, 8, 0);
+    if ((unsigned long long)size > 077777777777ULL) { // GNU base-256 size for files >= 8 GB
+        h[124] = 0x80;
+        for (int i = 135; i > 124; i--, size >>= 8)
+            h[i] = size & 0xff;
+    } else {
+        tar_octal((char *)h + 124, 12, size);
+    }
+    tar_octal((char *)h + 136, 12, mtime > 0 ? (unsigned long long)mtime : 0);
+    h[156] = type;
+    memcpy(h + 257, "ustar  ", 8); // GNU magic, needed for the long name records
+    memset(h + 148, ' ', 8);
+    for (size_t i = 0; i < sizeof(h); i++)
+        sum += h[i];
+    snprintf((char *)h + 148, 8, "%06o", sum);
+    h[155] = ' ';
+
+    archive_out_mem(ar, h, sizeof(h));
+}
+
+static void archive_send_tar(archive_t *ar) {
+    char name[PATH_MAX + 1];
+
+    for (size_t i = 0; i < ar->count && ar->pos < ar->end && !ar->failed; i++) {
+        archive_entry *e = &ar->entries[i];
+        size_t namelen = snprintf(name, sizeof(name), "%s%s", archive_path(ar, e), e->is_dir ? "/" : "");
+
+        if (namelen > 100) {
+            tar_header(ar, "././@LongLink", 13, namelen + 1, 0, 0644, 'L');
+            archive_out_mem(ar, name, namelen + 1);
+            archive_out_zeros(ar, tar_pad(namelen + 1));
+        }
+        tar_header(ar, name, namelen, e->size, e->mtime, e->mode, e->is_dir ? '5' : '0');
+        if (!e->is_dir) {
+            archive_out_file(ar, e);
+            archive_out_zeros(ar, tar_pad(e->size));
+        }
+    }
+    archive_out_zeros(ar, 1024);
+}
+
+static archive_crc_slot *archive_crc_slot_of(const archive_entry *e) {
+    uint64_t h = ((uint64_t)e->dev * 0x9E3779B97F4A7C15ull) ^ ((uint64_t)e->ino * 0xC2B2AE3D27D4EB4Full);
+    return &archive_crc_cache[(h >> 32) % ARCHIVE_CRC_CACHE];
+}
+
+static uint32_t archive_entry_crc(const archive_t *ar, archive_entry *e) {
+    if (e->has_crc || e->is_dir)
+        return e->crc;
+
+    archive_crc_slot *slot = archive_crc_slot_of(e);
+    pthread_mutex_lock(&archive_crc_lock);
+    if (slot->valid && slot->dev == e->dev && slot->ino == e->ino &&
+        slot->size == e->size && slot->mtime == e->mtime) {
+        e->crc = slot->crc;
+        e->has_crc = true;
+    }
+    pthread_mutex_unlock(&archive_crc_lock);
+    if (e->has_crc)
+        return e->crc;
+
+    uint32_t c = 0xFFFFFFFFu;
+    bool complete;
+    off_t left = e->size;
+    int in_fd = archive_open(ar, e);
+    unsigned char *buf = malloc(65536);
+    if (in_fd >= 0 && buf) {
+        ssize_t n;
+        posix_fadvise(in_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        while (left > 0 && (n = read(in_fd, buf, left > 65536 ? 65536 : left)) > 0) {
+            for (ssize_t i = 0; i < n; i++)
+                c = crc32_table[(c ^ buf[i]) & 0xff] ^ (c >> 8);
+            left -= n;
+        }
+    } else {
+        log_error("archive: cannot checksum %s\n", archive_path(ar, e));
+    }
+    complete = left == 0;
+    for (; left > 0; left--) // Match the zero padding archive_out_file sends for missing data
+        c = crc32_table[c & 0xff] ^ (c >> 8);
+    free(buf);
+    if (in_fd >= 0)
+        close(in_fd);
+    e->crc = c ^ 0xFFFFFFFFu;
+    e->has_crc = true;
+
+    if (complete) { // A padded checksum is only right for this request
+        pthread_mutex_lock(&archive_crc_lock);
+        *slot = (archive_crc_slot){ e->dev, e->ino, e->size, e->mtime, e->crc, true };
+        pthread_mutex_unlock(&archive_crc_lock);
+    }
+    return e->crc;
+}
+
+static void zip_dos_time(time_t t, uint16_t *dos_time, uint16_t *dos_date) {
+    struct tm tm_buf, *tm = localtime_r(&t, &tm_buf);
+    if (!tm || tm->tm_year < 80) {
+        *dos_time = 0;
+        *dos_date = (1 << 5) | 1; // 1980-01-01
+        return;
+    }
+    *dos_time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+    *dos_date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+}
+
+// Fills the fields shared by local and central headers, starting at "version needed"
+static void zip_common(unsigned char *p, const archive_t *ar, archive_entry *e, size_t namelen) {
+    uint16_t dos_time, dos_date;
+
+    zip_dos_time(e->mtime, &dos_time, &dos_date);
+    put16(p, 10);          // Version needed: 1.0, stored
+    put16(p + 2, 0x0800);  // Names are UTF-8
+    put16(p + 4, 0);       // Method: stored
+    put16(p + 6, dos_time);
+    put16(p + 8, dos_date);
+    put32(p + 10, archive_entry_crc(ar, e));
+    put32(p + 14, e->size);
+    put32(p + 18, e->size);
+    put16(p + 22, namelen);
+    put16(p + 24, 0);      // Extra field length
+}
+
+static void archive_send_zip(archive_t *ar) {
+    unsigned char h[46 + PATH_MAX + 1];
+    size_t i;
+
+    for (i = 0; i < ar->count && ar->pos < ar->end && !ar->failed; i++) {
+        archive_entry *e = &ar->entries[i];
+        size_t namelen = snprintf((char *)h + 30, PATH_MAX + 1, "%s%s", archive_path(ar, e), e->is_dir ? "/" : "");
+
+        if (archive_wants(ar, 30 + namelen)) {
+            put32(h, 0x04034b50);
+            zip_common(h + 4, ar, e, namelen);
+            archive_out_mem(ar, h, 30 + namelen);
+        } else {
+            ar->pos += 30 + namelen;
+        }
+        if (!e->is_dir)
+            archive_out_file(ar, e);
+    }
+
+    for (i = 0; i < ar->count && ar->pos < ar->end && !ar->failed; i++) {
+        archive_entry *e = &ar->entries[i];
+        size_t namelen = snprintf((char *)h + 46, PATH_MAX + 1, "%s%s", archive_path(ar, e), e->is_dir ? "/" : "");
+
+        if (!archive_wants(ar, 46 + namelen)) {
+            ar->pos += 46 + namelen;
+            continue;
+        }
+        put32(h, 0x02014b50);
+        put16(h + 4, (3 << 8) | 20); // Made by: Unix, 2.0
+        zip_common(h + 6, ar, e, namelen);
+        put16(h + 32, 0);            // Comment length
+        put16(h + 34, 0);            // Disk number
+        put16(h + 36, 0);            // Internal attributes
+        put32(h + 38, ((uint32_t)(e->mode | (e->is_dir ? S_IFDIR : S_IFREG)) << 16) | (e->is_dir ? 0x10 : 0));
+        put32(h + 42, e->header_off);
+        archive_out_mem(ar, h, 46 + namelen);
+    }
+
+    if (i == ar->count) {
+        put32(h, 0x06054b50);
+        put16(h + 4, 0);
+        put16(h + 6, 0);
+        put16(h + 8, ar->count);
+        put16(h + 10, ar->count);
+        put32(h + 12, ar->total_size - 22 - ar->cd_off);
+        put32(h + 16, ar->cd_off);
+        put16(h + 20, 0);
+        archive_out_mem(ar, h, 22);
+    }
+}
+
+// Streams the directory as an archive. Returns the HTTP status for logging.
+int serve_archive(int out_fd, const char *dirname, http_request *req, const char *format) {
+    char buf[MAXLINE], name[NAME_MAX + 1], root[PATH_MAX], etag[24];
+    archive_t ar;
+    int status;
+
+    // Same sandbox check as serve_static: a symlinked directory must not
+    // turn into an archive of whatever it points to
+    if (realpath(dirname, root) == NULL || !path_is_allowed(root)) {
+        client_error(out_fd, 403, "Forbidden", "Access denied");
+        return 403;
+    }
+
+    memset(&ar, 0, sizeof(ar));
+    if (strcmp(format, "tar") == 0) {
+        ar.format = ARCHIVE_TAR;
+    } else if (strcmp(format, "zip") == 0) {
+        ar.format = ARCHIVE_ZIP;
+    } else {
+        client_error(out_fd, 400, "Bad Request", "Unsupported archive format, use tar or zip");
+        return 400;
+    }
+    pthread_once(&crc32_once, crc32_init);
+    ar.root = root;
+    ar.root_len = strcmp(root, "/") == 0 ? 0 : strlen(root); // realpath adds no trailing slash elsewhere
+
+    if (!archive_collect(&ar, "", 0)) {
+        free(ar.entries);
+        free(ar.names);
+        client_error(out_fd, 500, "Internal Server Error", "Out of memory");
+        return 500;
+    }
+    for (size_t i = 0; i < ar.count; i++)
+        ar.entries[i].path = ar.names + ar.entries[i].path_off;
+    qsort(ar.entries, ar.count, sizeof(archive_entry), archive_cmp_path); // Stable layout for resumed downloads
+
+    if (!archive_layout(&ar)) {
+        free(ar.entries);
+        free(ar.names);
+        client_error(out_fd, 413, "Payload Too Large", "Directory is too large for zip, use ?archive=tar");
+        return 413;
+    }
+    flight_stage(STAGE_DIRLIST);
+
+    // A resumed download whose first part came from a different tree starts over
+    snprintf(etag, sizeof(etag), "\"%016llx\"", (unsigned long long)archive_etag(&ar));
+    if (req->has_range && req->if_range[0] && strcmp(req->if_range, etag) != 0) {
+        req->has_range = false;
+        req->offset = 0;
+        req->end = 0;
+    }
+    status = resolve_range(out_fd, req, ar.total_size);
+    if (status == 416) {
+        free(ar.entries);
+        free(ar.names);
+        return status;
+    }
+
+    // Download name: last path component, "archive" for the protected root
+    const char *base = dirname;
+    size_t blen = strlen(dirname);
+    while (blen > 1 && base[blen - 1] == '/')
+        blen--;
+    for (size_t i = 0; i < blen; i++) {
+        if (dirname[i] == '/' && i + 1 < blen)
+            base = dirname + i + 1;
+    }
+    blen -= base - dirname;
+    if (blen == 0 || blen > NAME_MAX || (blen == 1 && base[0] == '.')) {
+        snprintf(name, sizeof(name), "archive");
+    } else {
+        memcpy(name, base, blen);
+        name[blen] = '\0';
+        for (char *c = name; *c; c++) {
+            if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20)
+                *c = '_';
+        }
+    }
+
+    if (status == 206) {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)req->offset, (long long)req->end - 1, (long long)ar.total_size);
+    } else {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\n");
+    }
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+             "Accept-Ranges: bytes\r\nCache-Control: no-cache\r\nETag: %s\r\nContent-Length: %lld\r\n"
+             "Content-Type: %s\r\nContent-Disposition: attachment; filename=\"%s.%s\"\r\n\r\n",
+             etag, (long long)(req->end - req->offset),
+             ar.format == ARCHIVE_TAR ? "application/x-tar" : "application/zip", name, format);
+    writen(out_fd, buf, strlen(buf));
+
+    ar.out_fd = out_fd;
+    ar.start = req->offset;
+    ar.end = req->end;
+    if (ar.format == ARCHIVE_TAR)
+        archive_send_tar(&ar);
+    else
+        archive_send_zip(&ar);
+    flight_add_bytes((ar.pos < ar.end ? ar.pos : ar.end) - ar.start);
+    flight_stage(STAGE_SEND);
+
+    printf("serve_archive: %s.%s, %zu entries, %lld bytes total\n", name, format, ar.count, (long long)ar.total_size);
+    free(ar.entries);
+    free(ar.names);
+    return status;
+}
+
+
+bool path_is_allowed(const char *resolved_path) {
+    return strncmp(resolved_path, ALLOWED_ROOT_PREFIX, strlen(ALLOWED_ROOT_PREFIX)) == 0;
+}
+
+// Shared inotify watcher. Watch descriptors map to paths relative to the
+// web root; listeners get the path of every changed entry.
+static int tree_watch_fd = -1;
+static bool tree_watch_running = false;
+static pthread_mutex_t tree_watch_lock = PTHREAD_MUTEX_INITIALIZER;
+static char **tree_watch_paths = NULL; // Indexed by watch descriptor
+static size_t tree_watch_cap = 0;
+static tree_watch_fn tree_watch_listeners[TREE_WATCH_MAX_LISTENERS];
+static int tree_watch_nlisteners = 0;
+
+int tree_watch_init(void) {
+    pthread_mutex_lock(&tree_watch_lock);
+    if (tree_watch_fd < 0) {
+        tree_watch_fd = inotify_init1(IN_CLOEXEC);
+        if (tree_watch_fd < 0)
+            log_error("inotify_init1 failed: %s\n", strerror(errno));
+    }
+    int ok = tree_watch_fd >= 0;
+    pthread_mutex_unlock(&tree_watch_lock);
+    return ok ? 0 : -1;
+}
+
+void tree_watch_listen(tree_watch_fn fn) {
+    pthread_mutex_lock(&tree_watch_lock);
+    if (tree_watch_nlisteners < TREE_WATCH_MAX_LISTENERS)
+        tree_watch_listeners[tree_watch_nlisteners++] = fn;
+    pthread_mutex_unlock(&tree_watch_lock);
+}
+
+int tree_watch_add(const char *dir) {
+    int wd = inotify_add_watch(tree_watch_fd, dir, TREE_WATCH_MASK);
+    if (wd < 0)
+        return -1;
+
+    pthread_mutex_lock(&tree_watch_lock);
+    if ((size_t)wd >= tree_watch_cap) {
+        size_t ncap = tree_watch_cap ? tree_watch_cap * 2 : 1024;
+        while (ncap <= (size_t)wd) ncap *= 2;
+        char **tmp = realloc(tree_watch_paths, ncap * sizeof(char *));
+        if (!tmp) {
+            pthread_mutex_unlock(&tree_watch_lock);
+            inotify_rm_watch(tree_watch_fd, wd);
+            errno = ENOMEM;
+            return -1;
+        }
+        memset(tmp + tree_watch_cap, 0, (ncap - tree_watch_cap) * sizeof(char *));
+        tree_watch_paths = tmp;
+        tree_watch_cap = ncap;
+    }
+    free(tree_watch_paths[wd]);
+    tree_watch_paths[wd] = strdup(dir);
+    pthread_mutex_unlock(&tree_watch_lock);
+    return wd;
+}
+
+static void tree_watch_dispatch(const char *path, uint32_t mask) {
+    tree_watch_fn fns[TREE_WATCH_MAX_LISTENERS];
+    int n;
+
+    pthread_mutex_lock(&tree_watch_lock);
+    n = tree_watch_nlisteners;
+    memcpy(fns, tree_watch_listeners, n * sizeof(tree_watch_fn));
+    pthread_mutex_unlock(&tree_watch_lock);
+
+    for (int i = 0; i < n; i++)
+        fns[i](path, mask);
+}
+
+// False when dir/name does not fit in out; such paths are skipped, not truncated
+static bool tree_watch_join(char *out, size_t outsz, const char *dir, const char *name) {
+    int len;
+
+    if (strcmp(dir, ".") == 0)
+        len = snprintf(out, outsz, "%s", name);
+    else
+        len = snprintf(out, outsz, "%s/%s", dir, name);
+    return len >= 0 && (size_t)len < outsz;
+}
+
+// Watches dir and everything below it. With notify set every entry found is
+// reported as IN_CREATE, so listeners also learn about files that were
+// already there when a directory was moved into the tree.
+void tree_watch_add_tree(const char *dir, bool notify) {
+    char path[PATH_MAX];
+    struct dirent *dp;
+    struct stat st;
+
+    if (tree_watch_add(dir) < 0) {
+        log_error("inotify_add_watch(%s) failed: %s\n", dir, strerror(errno));
+        return;
+    }
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    while ((dp = readdir(d)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d), dp->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+            continue;
+        if (!tree_watch_join(path, sizeof(path), dir, dp->d_name))
+            continue;
+        if (notify)
+            tree_watch_dispatch(path, IN_CREATE | (S_ISDIR(st.st_mode) ? IN_ISDIR : 0));
+        if (S_ISDIR(st.st_mode))
+            tree_watch_add_tree(path, notify);
+    }
+    closedir(d);
+}
+
+// A directory moved away keeps its watches, drop them so stale paths are not reported
+static void tree_watch_forget(const char *dir) {
+    size_t len = strlen(dir);
+
+    pthread_mutex_lock(&tree_watch_lock);
+    for (size_t wd = 0; wd < tree_watch_cap; wd++) {
+        char *p = tree_watch_paths[wd];
+        if (p && strncmp(p, dir, len) == 0 && (p[len] == '\0' || p[len] == '/')) {
+            inotify_rm_watch(tree_watch_fd, wd);
+            free(p);
+            tree_watch_paths[wd] = NULL;
+        }
+    }
+    pthread_mutex_unlock(&tree_watch_lock);
+}
+
+static void *tree_watch_thread(void *arg) {
+    char buf[16384] __attribute__((aligned(8)));
+    char dir[PATH_MAX], path[PATH_MAX];
+    (void)arg;
+
+    for (;;) {
+        ssize_t n = read(tree_watch_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            log_error("inotify read failed: %s\n", strerror(errno));
+            tree_watch_dispatch(NULL, IN_Q_OVERFLOW);
+            return NULL;
+        }
+
+        for (char *p = buf; p < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                tree_watch_dispatch(NULL, ev->mask);
+                continue;
+            }
+
+            pthread_mutex_lock(&tree_watch_lock);
+            bool known = ev->wd >= 0 && (size_t)ev->wd < tree_watch_cap && tree_watch_paths[ev->wd];
+            if (known)
+                snprintf(dir, sizeof(dir), "%s", tree_watch_paths[ev->wd]);
+            if (known && (ev->mask & IN_IGNORED)) {
+                free(tree_watch_paths[ev->wd]);
+                tree_watch_paths[ev->wd] = NULL;
+            }
+            pthread_mutex_unlock(&tree_watch_lock);
+            if (!known)
+                continue;
+
+            // A watched directory itself went away, reported once more under its
+            // own path in case the event naming it in its parent was not seen
+            if (ev->len == 0) {
+                if ((ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) && strcmp(dir, ".") != 0) {
+                    if (ev->mask & IN_MOVE_SELF)
+                        tree_watch_forget(dir);
+                    tree_watch_dispatch(dir, ev->mask | IN_ISDIR);
+                }
+                continue;
+            }
+
+            if (!tree_watch_join(path, sizeof(path), dir, ev->name))
+                continue;
+            if ((ev->mask & IN_ISDIR) && (ev->mask & IN_MOVED_FROM))
+                tree_watch_forget(path);
+            tree_watch_dispatch(path, ev->mask);
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+                tree_watch_add_tree(path, true);
+        }
+    }
+}
+
+int tree_watch_start(void) {
+    pthread_t tid;
+
+    if (tree_watch_init() < 0)
+        return -1;
+    pthread_mutex_lock(&tree_watch_lock);
+    bool started = tree_watch_running;
+    tree_watch_running = true;
+    pthread_mutex_unlock(&tree_watch_lock);
+    if (started)
+        return 0;
+
+    if (pthread_create(&tid, NULL, tree_watch_thread, NULL) != 0) {
+        log_error("tree watch: could not create thread\n");
+        return -1;
+    }
+    pthread_detach(tid);
+    return 0;
+}
+
+// Web-root manifest: metadata lookups served from the mmap'ed index, with
+// an overlay of everything inotify reported since the index was built.
+
+uint64_t manifest_etag(const struct stat *st) {
+    uint64_t v[4] = { st->st_ino, st->st_size, st->st_mtim.tv_sec, st->st_mtim.tv_nsec };
+    uint64_t h = 1469598103934665603ULL; // FNV-1a over the identifying fields
+
+    for (int i = 0; i < 4; i++) {
+        for (int b = 0; b < 8; b++) {
+            h ^= (v[i] >> (b * 8)) & 0xff;
+            h *= 1099511628211ULL;
+        }
+    }
+    return h;
+}
+
+void manifest_fill(const char *path, const struct stat *st, manifest_entry *me) {
+    char resolved[PATH_MAX];
+    int mime = get_mime_index(path);
+
+    memset(me, 0, sizeof(*me));
+    me->mime = mime < 0 ? MANIFEST_MIME_DEFAULT : mime;
+    me->flags = S_ISDIR(st->st_mode) ? MF_DIR : 0;
+    if (realpath(path, resolved) && path_is_allowed(resolved))
+        me->flags |= MF_ALLOWED;
+    me->size = st->st_size;
+    me->mtime = st->st_mtime;
+    me->etag = manifest_etag(st);
+}
+
+static uint32_t path_hash(const char *s, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// First entry whose path is >= key
+static size_t manifest_lower_bound(const char *key) {
+    size_t lo = 0, hi = manifest.hdr->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (strcmp(manifest.strings + manifest.entries[mid].path_off, key) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static const manifest_entry *manifest_bsearch(const char *key) {
+    size_t i = manifest_lower_bound(key);
+    if (i < manifest.hdr->count && strcmp(manifest.strings + manifest.entries[i].path_off, key) == 0)
+        return &manifest.entries[i];
+    return NULL;
+}
+
+// Caller holds manifest.lock
+static overlay_entry *overlay_find(const char *path, size_t len) {
+    overlay_entry *o = manifest.overlay[path_hash(path, len) % MANIFEST_OVERLAY_BUCKETS];
+    for (; o; o = o->next) {
+        if (strncmp(o->path, path, len) == 0 && o->path[len] == '\0')
+            return o;
+    }
+    return NULL;
+}
+
+static void overlay_put(const char *path, const manifest_entry *meta, bool exists, bool subtree_reset,
+                        bool subtree_unknown) {
+    size_t len = strlen(path);
+
+    pthread_rwlock_wrlock(&manifest.lock);
+    overlay_entry *o = overlay_find(path, len);
+    if (!o) {
+        if (manifest.overlay_count >= MANIFEST_OVERLAY_MAX || !(o = malloc(sizeof(overlay_entry) + len + 1))) {
+            if (!manifest.stale)
+                log_error("Manifest overlay full, falling back to the filesystem\n");
+            manifest.stale = true;
+            pthread_rwlock_unlock(&manifest.lock);
+            return;
+        }
+        memcpy(o->path, path, len + 1);
+        o->subtree_reset = false;
+        o->subtree_unknown = false;
+        uint32_t b = path_hash(path, len) % MANIFEST_OVERLAY_BUCKETS;
+        o->next = manifest.overlay[b];
+        manifest.overlay[b] = o;
+        manifest.overlay_count++;
+    }
+    o->exists = exists;
+    o->subtree_reset = o->subtree_reset || subtree_reset;
+    if (subtree_unknown && !o->subtree_unknown) {
+        o->subtree_unknown = true;
+        manifest.overlay_unknown++;
+    }
+    if (meta)
+        o->meta = *meta;
+    pthread_rwlock_unlock(&manifest.lock);
+}
+
+// Returns 1 and fills out if path exists, 0 if it does not, -1 if the
+// manifest cannot tell and the caller has to ask the filesystem.
+int manifest_lookup(const char *path, manifest_entry *out) {
+    char key[PATH_MAX];
+    size_t len = strlen(path);
+    int result = -1;
+    bool ask_fs = false;
+
+    if (!manifest.enabled || manifest.stale || len >= sizeof(key))
+        return -1;
+    while (len > 1 && path[len - 1] == '/')
+        len--;
+    memcpy(key, path, len);
+    key[len] = '\0';
+
+    pthread_rwlock_rdlock(&manifest.lock);
+    if (manifest.overlay_count > 0) {
+        overlay_entry *a, *o = overlay_find(key, len);
+        if (o) {
+            result = o->exists;
+            if (o->exists)
+                *out = o->meta;
+        }
+        // Even a path of its own in the overlay may sit below a replaced symlink
+        for (size_t i = len; i-- > 0 && !ask_fs && (result < 0 || manifest.overlay_unknown > 0); ) {
+            if (key[i] != '/' || !(a = overlay_find(key, i)))
+                continue;
+            if (a->subtree_unknown)
+                ask_fs = true; // The index and MF_ALLOWED below it describe the old target
+            else if (result < 0 && (a->subtree_reset || !a->exists))
+                result = 0; // Ancestor was replaced: every live path below it is in the overlay
+        }
+    }
+    pthread_rwlock_unlock(&manifest.lock);
+    if (ask_fs)
+        return -1;
+    if (result >= 0)
+        return result;
+
+    const manifest_entry *e = manifest_bsearch(key);
+    if (!e)
+        return 0;
+    *out = *e;
+    return 1;
+}
+
+// subtree_reset: path was added, removed or replaced, so if it is a directory
+// now its manifest records are void and its entries get reported one by one.
+// A symlink reported that way can point anywhere, including outside the web
+// root; what is below it is left to the filesystem and its realpath checks.
+static void manifest_refresh_path(const char *path, bool subtree_reset) {
+    char variant[PATH_MAX];
+    manifest_entry me;
+    struct stat st, lst;
+    size_t len = strlen(path);
+
+    if (stat(path, &st) < 0) {
+        overlay_put(path, NULL, false, true, false);
+    } else {
+        bool link = subtree_reset && lstat(path, &lst) == 0 && S_ISLNK(lst.st_mode);
+        manifest_fill(path, &st, &me);
+        if (!S_ISDIR(st.st_mode)) {
+            snprintf(variant, sizeof(variant), "%s.gz", path);
+            if (access(variant, R_OK) == 0) me.flags |= MF_GZIP;
+            snprintf(variant, sizeof(variant), "%s.br", path);
+            if (access(variant, R_OK) == 0) me.flags |= MF_BROTLI;
+        }
+        overlay_put(path, &me, true, subtree_reset && S_ISDIR(st.st_mode) && !link, link);
+    }
+
+    // A precompressed variant changed: the original's flags follow it
+    if (len > 3 && (strcmp(path + len - 3, ".gz") == 0 || strcmp(path + len - 3, ".br") == 0)) {
+        snprintf(variant, sizeof(variant), "%.*s", (int)(len - 3), path);
+        if (manifest_lookup(variant, &me) == 1)
+            manifest_refresh_path(variant, false);
+    }
+}
+
+static void manifest_on_change(const char *path, uint32_t mask) {
+    if (!path) {
+        log_error("inotify queue overflow, manifest lookups fall back to the filesystem\n");
+        manifest.stale = true;
+        return;
+    }
+    manifest_refresh_path(path, mask & TREE_WATCH_NAMESPACE);
+}
+
+// Brings one directory that changed after the index was built up to date
+static void manifest_rescan_dir(const char *dir) {
+    char prefix[PATH_MAX], path[PATH_MAX];
+    struct dirent *dp;
+    struct stat st;
+
+    DIR *d = opendir(dir);
+    if (!d)
+        return;
+    while ((dp = readdir(d)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        if (!tree_watch_join(path, sizeof(path), dir, dp->d_name))
+            continue;
+        bool is_new_dir = !manifest_bsearch(path) && fstatat(dirfd(d), dp->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        manifest_refresh_path(path, is_new_dir);
+        if (is_new_dir)
+            tree_watch_add_tree(path, true);
+    }
+
+    // Direct children in the manifest that are gone now
+    if (strcmp(dir, ".") == 0)
+        prefix[0] = '\0';
+    else
+        snprintf(prefix, sizeof(prefix), "%s/", dir);
+    size_t plen = strlen(prefix);
+    for (size_t i = manifest_lower_bound(prefix); i < manifest.hdr->count; i++) {
+        const char *p = manifest.strings + manifest.entries[i].path_off;
+        if (strncmp(p, prefix, plen) != 0)
+            break;
+        if (strcmp(p, ".") == 0 || strchr(p + plen, '/'))
+            continue;
+        if (fstatat(dirfd(d), p + plen, &st, 0) < 0)
+            overlay_put(p, NULL, false, true, false);
+    }
+    closedir(d);
+}
+
+static void *manifest_watch_setup(void *arg) {
+    size_t watched = 0, rescanned = 0;
+    struct stat st;
+    (void)arg;
+
+    for (size_t i = 0; i < manifest.hdr->count; i++) {
+        const manifest_entry *e = &manifest.entries[i];
+        const char *path = manifest.strings + e->path_off;
+
+        if (!(e->flags & MF_DIR))
+            continue;
+        if (tree_watch_add(path) < 0) {
+            if (errno == ENOENT) {
+                overlay_put(path, NULL, false, true, false);
+                continue;
+            }
+            log_error("inotify_add_watch(%s) failed: %s, manifest lookups fall back to the filesystem\n",
+                      path, strerror(errno));
+            manifest.stale = true;
+            return NULL;
+        }
+        watched++;
+        if (stat(path, &st) == 0 && st.st_mtime >= manifest.hdr->built) {
+            manifest_rescan_dir(path);
+            rescanned++;
+        }
+    }
+    log_message("Manifest: watching %zu directories, %zu changed since indexing\n", watched, rescanned);
+    return NULL;
+}
+
+int manifest_open(const char *file) {
+    struct stat st;
+    int fd = open(file, O_RDONLY);
+
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        log_error("Cannot open manifest %s: %s\n", file, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    void *base = st.st_size >= (off_t)sizeof(manifest_header) ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+        log_error("Cannot map manifest %s\n", file);
+        return -1;
+    }
+
+    const manifest_header *hdr = base;
+    if (hdr->magic != MANIFEST_MAGIC || hdr->version != MANIFEST_VERSION ||
+        hdr->entry_size != sizeof(manifest_entry) ||
+        hdr->strings_off < sizeof(manifest_header) + (uint64_t)hdr->count * sizeof(manifest_entry) ||
+        hdr->strings_len == 0 || hdr->strings_off + hdr->strings_len != (uint64_t)st.st_size ||
+        ((const char *)base)[st.st_size - 1] != '\0') {
+        log_error("Manifest %s is invalid or was built for another version\n", file);
+        munmap(base, st.st_size);
+        return -1;
+    }
+
+    // Every path has to lie inside the string table, or lookups would read past the mapping
+    const manifest_entry *entries = (const manifest_entry *)(hdr + 1);
+    const char *strings = (const char *)base + hdr->strings_off;
+    for (uint32_t i = 0; i < hdr->count; i++) {
+        const manifest_entry *e = &entries[i];
+        if ((uint64_t)e->path_off + e->path_len >= hdr->strings_len || strings[e->path_off + e->path_len] != '\0' ||
+            memchr(strings + e->path_off, '\0', e->path_len)) {
+            log_error("Manifest %s: entry %u has a bad path, serving from the filesystem\n", file, i);
+            munmap(base, st.st_size);
+            return 0;
+        }
+    }
+
+    manifest.base = base;
+    manifest.len = st.st_size;
+    manifest.hdr = hdr;
+    manifest.entries = entries;
+    manifest.strings = strings;
+    pthread_rwlock_init(&manifest.lock, NULL);
+    manifest.enabled = true;
+    madvise(base, st.st_size, MADV_RANDOM);
+    log_message("Manifest: %u entries from %s\n", hdr->count, file);
+    return 0;
+}
+
+// Starts keeping the manifest current; paths are relative to the web root
+void manifest_watch_start(void) {
+    pthread_t tid;
+
+    tree_watch_listen(manifest_on_change);
+    if (tree_watch_start() < 0 || pthread_create(&tid, NULL, manifest_watch_setup, NULL) != 0) {
+        log_error("Manifest cannot be kept current, lookups fall back to the filesystem\n");
+        manifest.stale = true;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+// Serves a regular file straight from manifest metadata: one open(), no
+// stat or realpath. Precompressed .br/.gz siblings are used when the
+// client accepts them (full responses only).
+int serve_manifest_file(int out_fd, http_request *req, const manifest_entry *me) {
+    char buf[MAXLINE], path[PATH_MAX + 3], etag[32], last_modified[64];
+    const char *encoding = NULL;
+    manifest_entry body = *me, variant;
+    struct tm tm_buf;
+    time_t mtime = me->mtime;
+    int status;
+
+    if (!(me->flags & MF_ALLOWED)) {
+        client_error(out_fd, 403, "Forbidden", "Access denied");
+        return 403;
+    }
+
+    snprintf(path, sizeof(path), "%s", req->filename);
+    if (!req->has_range) {
+        if ((me->flags & MF_BROTLI) && req->accept_br) {
+            snprintf(path, sizeof(path), "%s.br", req->filename);
+            if (manifest_lookup(path, &variant) == 1 && (variant.flags & MF_ALLOWED))
+                encoding = "br";
+        }
+        if (!encoding && (me->flags & MF_GZIP) && req->accept_gzip) {
+            snprintf(path, sizeof(path), "%s.gz", req->filename);
+            if (manifest_lookup(path, &variant) == 1 && (variant.flags & MF_ALLOWED))
+                encoding = "gzip";
+        }
+        if (encoding)
+            body = variant;
+        else
+            snprintf(path, sizeof(path), "%s", req->filename);
+    }
+
+    snprintf(etag, sizeof(etag), "\"%016llx%s%s\"", (unsigned long long)me->etag,
+             encoding ? "-" : "", encoding ? encoding : "");
+    if (req->if_none_match[0] && (strcmp(req->if_none_match, etag) == 0 || strcmp(req->if_none_match, "*") == 0)) {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n\r\n", etag);
+        writen(out_fd, buf, strlen(buf));
+        return 304;
+    }
+
+    int in_fd = open(path, O_RDONLY);
+    if (in_fd < 0) {
+        client_error(out_fd, 404, "Not found", "File not found");
+        return 404;
+    }
+    flight_stage(STAGE_RESOLVE);
+
+    status = resolve_range(out_fd, req, body.size);
+    if (status == 416) {
+        close(in_fd);
+        return status;
+    }
+
+    strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", gmtime_r(&mtime, &tm_buf));
+    if (status == 206) {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes %lld-%lld/%lld\r\n",
+                 (long long)req->offset, (long long)req->end - 1, (long long)body.size);
+    } else {
+        snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n");
+    }
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf),
+             "Cache-Control: no-cache\r\nETag: %s\r\nLast-Modified: %s\r\nContent-Length: %lld\r\nContent-Type: %s\r\n",
+             etag, last_modified, (long long)(req->end - req->offset),
+             me->mime < MIME_TYPES_COUNT ? meme_types[me->mime].mime_type : default_mime_type);
+    if (encoding)
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Encoding: %s\r\n", encoding);
+    if (me->flags & (MF_GZIP | MF_BROTLI))
+        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Vary: Accept-Encoding\r\n");
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "\r\n");
+    writen(out_fd, buf, strlen(buf));
+
+    if (req->end - req->offset >= STREAM_MIN_SIZE &&
+        stream_submit(out_fd, in_fd, req->offset, req->end, body.size)) {
+        flight_add_bytes(req->end - req->offset);
+        flight_stage(STAGE_SEND); // Hand-off time, the engine keeps sending
+        return status; // The streaming engine owns in_fd from here on
+    }
+    flight_add_bytes(send_file_range(out_fd, in_fd, req->offset, req->end));
+    flight_stage(STAGE_SEND);
+    close(in_fd);
+    return status;
+}
+
+// Filename search (-s): every path below the web root with trigram
+// postings over the lower-cased basenames. Ids are handed out in insertion
+// order, so postings stay sorted; removed entries are only flagged and are
+// dropped by the next rebuild. Entries are also linked into a tree below
+// their directory, so a search from a small subtree walks just that
+// subtree. All changes happen under search_lock.
+
+static search_index *search_index_new(void) {
+    search_index *ix = calloc(1, sizeof(search_index));
+    if (!ix)
+        return NULL;
+    ix->nbuckets = 1 << 16;
+    ix->buckets = calloc(ix->nbuckets, sizeof(uint32_t));
+    ix->grams_cap = 1 << 12;
+    ix->grams = calloc(ix->grams_cap, sizeof(search_posting));
+    ix->count = 1; // Id 0 means "none"
+    if (!ix->buckets || !ix->grams) {
+        free(ix->buckets);
+        free(ix->grams);
+        free(ix);
+        return NULL;
+    }
+    return ix;
+}
+
+static void search_index_free(search_index *ix) {
+    if (!ix)
+        return;
+    for (uint32_t i = 0; i < ix->grams_cap; i++)
+        free(ix->grams[i].ids);
+    free(ix->grams);
+    free(ix->buckets);
+    free(ix->entries);
+    free(ix->arena);
+    free(ix);
+}
+
+static inline const char *search_path(const search_index *ix, uint32_t id) {
+    return ix->arena + ix->entries[id].path_off;
+}
+
+static inline uint32_t search_gram_slot(uint32_t key, uint32_t cap) {
+    return (key * 2654435761u) & (cap - 1);
+}
+
+// Posting list for a trigram key, created on demand when add is set
+static search_posting *search_gram(search_index *ix, uint32_t key, bool add) {
+    uint32_t i = search_gram_slot(key, ix->grams_cap);
+
+    while (ix->grams[i].key != 0) {
+        if (ix->grams[i].key == key)
+            return &ix->grams[i];
+        i = (i + 1) & (ix->grams_cap - 1);
+    }
+    if (!add)
+        return NULL;
+    if ((ix->grams_used + 1) * 2 > ix->grams_cap) {
+        uint32_t ncap = ix->grams_cap * 2;
+        search_posting *tmp = calloc(ncap, sizeof(search_posting));
+        if (!tmp)
+            return NULL;
+        for (uint32_t j = 0; j < ix->grams_cap; j++) {
+            if (ix->grams[j].key == 0)
+                continue;
+            uint32_t k = search_gram_slot(ix->grams[j].key, ncap);
+            while (tmp[k].key != 0)
+                k = (k + 1) & (ncap - 1);
+            tmp[k] = ix->grams[j];
+        }
+        free(ix->grams);
+        ix->grams = tmp;
+        ix->grams_cap = ncap;
+        return search_gram(ix, key, add);
+    }
+    ix->grams[i].key = key;
+    ix->grams_used++;
+    return &ix->grams[i];
+}
+
+static inline uint32_t search_gram_key(const char *s) {
+    return ((uint32_t)(unsigned char)tolower((unsigned char)s[0]) << 16 |
+            (uint32_t)(unsigned char)tolower((unsigned char)s[1]) << 8 |
+            (uint32_t)(unsigned char)tolower((unsigned char)s[2])) + 1;
+}
+
+static uint32_t search_find(const search_index *ix, const char *path, size_t len) {
+    uint32_t id = ix->buckets[path_hash(path, len) & (ix->nbuckets - 1)];
+    while (id && (ix->entries[id].path_len != len || memcmp(search_path(ix, id), path, len) != 0))
+        id = ix->entries[id].hnext;
+    return id;
+}
+
+static void search_rehash(search_index *ix) {
+    uint32_t nb = ix->nbuckets * 2;
+    uint32_t *tmp = calloc(nb, sizeof(uint32_t));
+    if (!tmp)
+        return; // Longer chains, still correct
+    for (uint32_t id = 1; id < ix->count; id++) {
+        search_entry *e = &ix->entries[id];
+        if (e->flags & SEARCH_DELETED)
+            continue;
+        uint32_t b = path_hash(search_path(ix, id), e->path_len) & (nb - 1);
+        e->hnext = tmp[b];
+        tmp[b] = id;
+    }
+    free(ix->buckets);
+    ix->buckets = tmp;
+    ix->nbuckets = nb;
+}
+
+// Adds the first len bytes of path below its directory, which has to be indexed already
+static bool search_insert(search_index *ix, const char *path, size_t len, bool is_dir) {
+    uint32_t id = search_find(ix, path, len);
+
+    if (id) {
+        ix->entries[id].flags = is_dir ? SEARCH_DIR : 0;
+        return true;
+    }
+    if (len > UINT16_MAX || ix->count == UINT32_MAX || ix->arena_len + len + 1 > UINT32_MAX)
+        return false;
+    const char *slash = memrchr(path, '/', len);
+    uint32_t parent = slash ? search_find(ix, path, slash - path) : 0;
+    if (slash && !parent)
+        return false;
+    if (ix->count >= ix->cap) { // count starts at 1 with nothing allocated
+        uint32_t ncap = ix->cap ? ix->cap * 2 : 4096;
+        search_entry *tmp = realloc(ix->entries, ncap * sizeof(search_entry));
+        if (!tmp)
+            return false;
+        if (!ix->entries)
+            memset(&tmp[0], 0, sizeof(tmp[0])); // The root
+        ix->entries = tmp;
+        ix->cap = ncap;
+    }
+    if (ix->arena_len + len + 1 > ix->arena_cap) {
+        size_t ncap = ix->arena_cap ? ix->arena_cap * 2 : 65536;
+        while (ncap < ix->arena_len + len + 1) ncap *= 2;
+        char *tmp = realloc(ix->arena, ncap);
+        if (!tmp)
+            return false;
+        ix->arena = tmp;
+        ix->arena_cap = ncap;
+    }
+
+    id = ix->count++;
+    search_entry *e = &ix->entries[id];
+    e->path_off = ix->arena_len;
+    e->path_len = len;
+    e->base_off = slash ? slash - path + 1 : 0;
+    e->flags = is_dir ? SEARCH_DIR : 0;
+    memcpy(ix->arena + ix->arena_len, path, len);
+    ix->arena[ix->arena_len + len] = '\0';
+    ix->arena_len += len + 1;
+    uint32_t b = path_hash(path, len) & (ix->nbuckets - 1);
+    e->hnext = ix->buckets[b];
+    ix->buckets[b] = id;
+    ix->live++;
+    e->parent = parent;
+    e->child = 0;
+    e->below = 0;
+    e->sibling = ix->entries[parent].child;
+    ix->entries[parent].child = id;
+    for (uint32_t a = parent; ; a = ix->entries[a].parent) {
+        ix->entries[a].below++;
+        if (a == 0)
+            break;
+    }
+
+    const char *base = search_path(ix, id) + e->base_off;
+    for (size_t i = 0; base[i] && base[i + 1] && base[i + 2]; i++) {
+        search_posting *p = search_gram(ix, search_gram_key(base + i), true);
+        if (!p || (p->count && p->ids[p->count - 1] == id)) // Repeated trigram in one name
+            continue;
+        if (p->count == p->cap) {
+            uint32_t ncap = p->cap ? p->cap * 2 : 4;
+            uint32_t *tmp = realloc(p->ids, ncap * sizeof(uint32_t));
+            if (!tmp)
+                continue;
+            p->ids = tmp;
+            p->cap = ncap;
+        }
+        p->ids[p->count++] = id;
+    }
+    if (ix->live > ix->nbuckets)
+        search_rehash(ix);
+    return true;
+}
+
+// Directories missing above path are added first. The walkers can get to a
+// directory's contents before its own entry is flushed.
+static bool search_add(search_index *ix, const char *path, bool is_dir) {
+    size_t len = strlen(path);
+    const char *slash = memrchr(path, '/', len);
+
+    if (slash && !search_find(ix, path, slash - path)) {
+        for (const char *p = strchr(path, '/'); p && p <= slash; p = strchr(p + 1, '/')) {
+            if (!search_find(ix, path, p - path) && !search_insert(ix, path, p - path, true))
+                return false;
+        }
+    }
+    return search_insert(ix, path, len, is_dir);
+}
+
+// Next entry below top in depth-first order, 0 past the end. Removed
+// directories are not entered, their contents were removed with them.
+static uint32_t search_next_below(const search_index *ix, uint32_t top, uint32_t id) {
+    const search_entry *e = &ix->entries[id];
+
+    if (e->child && !(e->flags & SEARCH_DELETED))
+        return e->child;
+    while (id != top && !ix->entries[id].sibling)
+        id = ix->entries[id].parent;
+    return id == top ? 0 : ix->entries[id].sibling;
+}
+
+static void search_unlink(search_index *ix, uint32_t id) {
+    search_entry *e = &ix->entries[id];
+    uint32_t *link = &ix->buckets[path_hash(search_path(ix, id), e->path_len) & (ix->nbuckets - 1)];
+
+    while (*link && *link != id)
+        link = &ix->entries[*link].hnext;
+    if (*link)
+        *link = e->hnext;
+    e->flags |= SEARCH_DELETED;
+    ix->live--;
+    ix->deleted++;
+}
+
+// Removes path and, for directories, everything that was below it
+static void search_remove(search_index *ix, const char *path) {
+    size_t len = strlen(path);
+    uint32_t id = search_find(ix, path, len);
+
+    if (!id)
+        return;
+    search_unlink(ix, id);
+    for (uint32_t i = ix->entries[id].child, next; i; i = next) {
+        next = search_next_below(ix, id, i); // Before i is flagged, so its contents are visited
+        if (!(ix->entries[i].flags & SEARCH_DELETED))
+            search_unlink(ix, i);
+    }
+}
+
+// Parallel walker: SEARCH_WALK_THREADS workers share a queue of
+// directories. Entries of one directory are inserted in a single batch,
+// symlinked directories are followed once (by device and inode).
+typedef struct search_dir {
+    struct search_dir *next;
+    char path[];
+} search_dir;
+
+typedef struct search_seen {
+    struct search_seen *next;
+    dev_t dev;
+    ino_t ino;
+} search_seen;
+
+typedef struct {
+    search_index *ix;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    search_dir *queue;
+    int busy;               // Workers holding a directory
+    search_seen *seen[1024];
+    size_t dirs, entries;
+} search_walk;
+
+// Queues dir unless it was seen before; called with walk->lock held
+static void search_walk_push(search_walk *w, const char *dir, const struct stat *st) {
+    search_seen **bucket = &w->seen[(st->st_dev * 31 + st->st_ino) % 1024];
+
+    for (search_seen *s = *bucket; s; s = s->next) {
+        if (s->dev == st->st_dev && s->ino == st->st_ino)
+            return;
+    }
+    search_seen *s = malloc(sizeof(search_seen));
+    search_dir *d = malloc(sizeof(search_dir) + strlen(dir) + 1);
+    if (!s || !d) {
+        free(s);
+        free(d);
+        log_error("Search index: out of memory, skipping %s\n", dir);
+        return;
+    }
+    s->dev = st->st_dev;
+    s->ino = st->st_ino;
+    s->next = *bucket;
+    *bucket = s;
+    strcpy(d->path, dir);
+    d->next = w->queue;
+    w->queue = d;
+}
+
+static void search_walk_flush(search_walk *w, char *batch, size_t len, size_t *n) {
+    pthread_rwlock_wrlock(&search_lock);
+    for (size_t off = 0; off < len; off += strlen(batch + off) + 1) // Each record: type byte + path
+        search_add(w->ix, batch + off + 1, batch[off] == 'd');
+    pthread_rwlock_unlock(&search_lock);
+    pthread_mutex_lock(&w->lock);
+    w->entries += *n;
+    pthread_mutex_unlock(&w->lock);
+    *n = 0;
+}
+
+static void search_walk_dir(search_walk *w, const char *dir) {
+    char path[PATH_MAX], *batch = malloc(SEARCH_BATCH);
+    size_t len = 0, n = 0;
+    struct dirent *dp;
+    struct stat st;
+
+    tree_watch_add(dir); // Before reading, so nothing created meanwhile is missed
+    DIR *d = opendir(dir);
+    if (!d || !batch) {
+        if (d) closedir(d);
+        free(batch);
+        return;
+    }
+    while ((dp = readdir(d)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        bool is_dir = dp->d_type == DT_DIR;
+        if (dp->d_type == DT_DIR || dp->d_type == DT_LNK || dp->d_type == DT_UNKNOWN) {
+            if (fstatat(dirfd(d), dp->d_name, &st, 0) < 0)
+                continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        if (!tree_watch_join(path, sizeof(path), dir, dp->d_name))
+            continue;
+        size_t plen = strlen(path);
+        if (len + plen + 2 > SEARCH_BATCH) {
+            search_walk_flush(w, batch, len, &n);
+            len = 0;
+        }
+        batch[len] = is_dir ? 'd' : 'f';
+        memcpy(batch + len + 1, path, plen + 1);
+        len += plen + 2;
+        n++;
+        if (is_dir) {
+            pthread_mutex_lock(&w->lock);
+            search_walk_push(w, path, &st);
+            pthread_cond_signal(&w->cond);
+            pthread_mutex_unlock(&w->lock);
+        }
+    }
+    closedir(d);
+    search_walk_flush(w, batch, len, &n);
+    free(batch);
+}
+
+static void *search_walk_thread(void *arg) {
+    search_walk *w = arg;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->queue && w->busy > 0)
+            pthread_cond_wait(&w->cond, &w->lock);
+        if (!w->queue)
+            break; // Queue empty and nobody left to refill it
+        search_dir *d = w->queue;
+        w->queue = d->next;
+        w->busy++;
+        w->dirs++;
+        pthread_mutex_unlock(&w->lock);
+
+        search_walk_dir(w, d->path);
+        free(d);
+
+        pthread_mutex_lock(&w->lock);
+        if (--w->busy == 0 && !w->queue)
+            pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+// Walks the web root into ix; returns false if the root is unreadable
+static bool search_build(search_index *ix) {
+    pthread_t tids[SEARCH_WALK_THREADS];
+    search_walk w;
+    struct stat st;
+    struct timespec t0, t1;
+    int started = 0;
+
+    if (stat(".", &st) < 0)
+        return false;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(&w, 0, sizeof(w));
+    w.ix = ix;
+    pthread_mutex_init(&w.lock, NULL);
+    pthread_cond_init(&w.cond, NULL);
+    search_walk_push(&w, ".", &st);
+
+    for (int i = 0; i < SEARCH_WALK_THREADS; i++) {
+        if (pthread_create(&tids[started], NULL, search_walk_thread, &w) == 0)
+            started++;
+    }
+    if (started == 0)
+        search_walk_thread(&w);
+    for (int i = 0; i < started; i++)
+        pthread_join(tids[i], NULL);
+
+    for (int i = 0; i < 1024; i++) {
+        while (w.seen[i]) {
+            search_seen *s = w.seen[i];
+            w.seen[i] = s->next;
+            free(s);
+        }
+    }
+    pthread_mutex_destroy(&w.lock);
+    pthread_cond_destroy(&w.cond);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    log_message("Search index: %zu entries in %zu directories, %u trigrams, built in %.0f ms\n",
+                w.entries, w.dirs, ix->grams_used,
+                (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+    return true;
+}
+
+// Builds a fresh index next to the live one and swaps it in. Changes
+// reported meanwhile are applied to both.
+static void *search_rebuild_thread(void *arg) {
+    search_index *ix = search_index_new(), *old;
+    (void)arg;
+
+    if (!ix) {
+        log_error("Search index: out of memory, rebuild skipped\n");
+        search_rebuilding = false;
+        return NULL;
+    }
+    pthread_rwlock_wrlock(&search_lock);
+    search_shadow = ix;
+    pthread_rwlock_unlock(&search_lock);
+
+    search_build(ix);
+
+    pthread_rwlock_wrlock(&search_lock);
+    old = search_live;
+    search_live = ix;
+    search_shadow = NULL;
+    pthread_rwlock_unlock(&search_lock);
+    search_index_free(old);
+    search_rebuilding = false;
+    return NULL;
+}
+
+static void search_schedule_rebuild(void) {
+    pthread_t tid;
+
+    if (__sync_lock_test_and_set(&search_rebuilding, true))
+        return;
+    if (pthread_create(&tid, NULL, search_rebuild_thread, NULL) != 0) {
+        search_rebuilding = false;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+static void search_on_change(const char *path, uint32_t mask) {
+    search_index *targets[2];
+    bool compact;
+
+    if (!path) {
+        log_error("inotify queue overflow, rebuilding the search index\n");
+        search_schedule_rebuild();
+        return;
+    }
+    if (!(mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM)))
+        return;
+
+    pthread_rwlock_wrlock(&search_lock);
+    targets[0] = search_live;
+    targets[1] = search_shadow;
+    for (int i = 0; i < 2; i++) {
+        if (!targets[i])
+            continue;
+        if (mask & (IN_CREATE | IN_MOVED_TO))
+            search_add(targets[i], path, mask & IN_ISDIR);
+        else
+            search_remove(targets[i], path);
+    }
+    compact = search_live && search_live->deleted > SEARCH_COMPACT_MIN && search_live->deleted > search_live->live;
+    pthread_rwlock_unlock(&search_lock);
+    if (compact)
+        search_schedule_rebuild();
+}
+
+static void *search_start_thread(void *arg) {
+    (void)arg;
+    if (!search_build(search_live))
+        log_error("Search index: cannot read the web root\n");
+    return NULL;
+}
+
+// Indexes the web root in the background; queries see entries as they are added
+int search_start(void) {
+    pthread_t tid;
+
+    if (!(search_live = search_index_new()))
+        return -1;
+    tree_watch_listen(search_on_change);
+    if (tree_watch_start() < 0)
+        log_error("Search index will not follow changes to the web root\n");
+    if (pthread_create(&tid, NULL, search_start_thread, NULL) != 0)
+        return -1;
+    pthread_detach(tid);
+    return 0;
+}
+
+// Case-insensitive substring match on basenames below dir. Fills ids with
+// matches number skip.. and returns how many were found, stopping once max
+// of them are collected. The posting lists are intersected in index order,
+// unless dir has fewer entries below it than the shortest list: then its
+// subtree is walked instead. Needles under 3 bytes have no trigrams, so
+// from the root they are a scan of the whole index, cut short by max.
+static size_t search_query(const search_index *ix, const char *dir, const char *needle,
+                           size_t skip, uint32_t *ids, size_t max) {
+    size_t dlen = strcmp(dir, ".") == 0 ? 0 : strlen(dir);
+    size_t nlen = strlen(needle), found = 0, nlists = 0;
+    const search_posting *lists[SEARCH_MAX_QUERY];
+    size_t cursor[SEARCH_MAX_QUERY];
+    uint32_t scope = dlen ? search_find(ix, dir, dlen) : 0;
+
+    if (!ix->entries || (dlen && (!scope || !(ix->entries[scope].flags & SEARCH_DIR))))
+        return 0; // Nothing indexed below dir (yet)
+
+    if (nlen >= 3) {
+        for (size_t i = 0; i + 2 < nlen && nlists < SEARCH_MAX_QUERY; i++) {
+            const search_posting *p = search_gram((search_index *)ix, search_gram_key(needle + i), false);
+            if (!p)
+                return 0; // Some trigram occurs in no name at all
+            bool dup = false;
+            for (size_t j = 0; j < nlists; j++)
+                dup = dup || lists[j] == p;
+            if (!dup)
+                lists[nlists++] = p;
+        }
+        for (size_t i = 1; i < nlists; i++) { // Shortest list drives the intersection
+            for (size_t j = i; j > 0 && lists[j]->count < lists[j - 1]->count; j--) {
+                const search_posting *t = lists[j];
+                lists[j] = lists[j - 1];
+                lists[j - 1] = t;
+            }
+        }
+        memset(cursor, 0, sizeof(cursor));
+    }
+
+    if (ix->entries[scope].below < (nlists ? lists[0]->count : ix->count - 1)) {
+        for (uint32_t id = ix->entries[scope].child; id && found < skip + max; id = search_next_below(ix, scope, id)) {
+            const search_entry *e = &ix->entries[id];
+            if ((e->flags & SEARCH_DELETED) || !strcasestr(search_path(ix, id) + e->base_off, needle))
+                continue;
+            if (found++ >= skip)
+                ids[found - skip - 1] = id;
+        }
+        return found > skip ? found - skip : 0;
+    }
+
+    size_t n = nlists ? lists[0]->count : ix->count;
+    for (size_t k = nlists ? 0 : 1; k < n && found < skip + max; k++) {
+        uint32_t id = nlists ? lists[0]->ids[k] : k;
+        bool in_all = true;
+
+        for (size_t j = 1; j < nlists && in_all; j++) { // Galloping search, cursors only move forward
+            const search_posting *p = lists[j];
+            size_t lo = cursor[j], step = 1, hi;
+            while (lo + step < p->count && p->ids[lo + step] < id)
+                step *= 2;
+            hi = lo + step < p->count ? lo + step + 1 : p->count;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (p->ids[mid] < id)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            cursor[j] = lo;
+            in_all = lo < p->count && p->ids[lo] == id;
+        }
+        if (!in_all)
+            continue;
+
+        const search_entry *e = &ix->entries[id];
+        const char *path = search_path(ix, id);
+        if ((e->flags & SEARCH_DELETED) ||
+            (dlen && (e->path_len <= dlen || path[dlen] != '/' || memcmp(path, dir, dlen) != 0)) ||
+            !strcasestr(path + e->base_off, needle))
+            continue;
+        if (found++ >= skip)
+            ids[found - skip - 1] = id;
+    }
+    return found > skip ? found - skip : 0;
+}
+
+// ?search=text[&offset=N&limit=N&format=json] on a protected directory:
+// matching entries below it, as listing rows named relative to dir
+int serve_search(int out_fd, const char *dirname, const char *icon_style, const char *query, const char *needle, bool http10) {
+    char dir[PATH_MAX], buf[MAXLINE], param[32], escaped_dir[MAXLINE], escaped_needle[MAXLINE];
+    size_t offset = 0, limit = SEARCH_DEFAULT_LIMIT, n, plen;
+    bool json = false;
+
+    if (get_query_param(query, "format", param, sizeof(param)))
+        json = strcmp(param, "json") == 0;
+    if (get_query_param(query, "offset", param, sizeof(param)))
+        offset = strtoul(param, NULL, 10);
+    if (get_query_param(query, "limit", param, sizeof(param)))
+        limit = strtoul(param, NULL, 10);
+    if (limit == 0 || limit > SEARCH_MAX_LIMIT)
+        limit = SEARCH_MAX_LIMIT;
+
+    snprintf(dir, sizeof(dir), "%s", dirname);
+    for (size_t len = strlen(dir); len > 1 && dir[len - 1] == '/'; len--)
+        dir[len - 1] = '\0';
+    plen = strcmp(dir, ".") == 0 ? 0 : strlen(dir) + 1;
+
+    // Matching paths are copied out so the index is not locked while sending
+    uint32_t *ids = malloc((limit + 1) * sizeof(uint32_t));
+    char *names = NULL;
+    size_t *offs = malloc((limit + 1) * sizeof(size_t)), names_len = 0;
+    bool *dirs = malloc((limit + 1) * sizeof(bool));
+    chunked_t *cw = malloc(sizeof(chunked_t));
+    int dfd = open(dir, O_RDONLY | O_DIRECTORY);
+
+    n = 0;
+    if (ids && offs && dirs && cw && dfd >= 0) {
+        pthread_rwlock_rdlock(&search_lock);
+        n = search_query(search_live, dir, needle, offset, ids, limit + 1);
+        size_t total_len = 0;
+        for (size_t i = 0; i < n; i++)
+            total_len += search_live->entries[ids[i]].path_len - plen + 1;
+        names = malloc(total_len ? total_len : 1);
+        for (size_t i = 0; names && i < n; i++) {
+            const search_entry *e = &search_live->entries[ids[i]];
+            offs[i] = names_len;
+            dirs[i] = e->flags & SEARCH_DIR;
+            memcpy(names + names_len, search_path(search_live, ids[i]) + plen, e->path_len - plen + 1);
+            names_len += e->path_len - plen + 1;
+        }
+        pthread_rwlock_unlock(&search_lock);
+    }
+    if (!ids || !offs || !dirs || !cw || dfd < 0 || !names) {
+        free(ids); free(offs); free(dirs); free(cw); free(names);
+        if (dfd >= 0) close(dfd);
+        client_error(out_fd, 500, "Internal Server Error", "Search failed");
+        return 500;
+    }
+    bool more = n > limit;
+    if (more)
+        n = limit;
+
+    send_page_head(out_fd, json ? "application/json; charset=utf-8" : "text/html; charset=utf-8", http10);
+    chunked_init(cw, out_fd, !http10);
+
+    if (json) {
+        json_escape(dir, escaped_dir, sizeof(escaped_dir));
+        json_escape(needle, escaped_needle, sizeof(escaped_needle));
+        chunked_printf(cw, "{\"path\":\"%s\",\"search\":\"%s\",\"offset\":%zu,\"entries\":[",
+                       escaped_dir, escaped_needle, offset);
+    } else {
+        html_escape(dir, escaped_dir, sizeof(escaped_dir));
+        html_escape(needle, escaped_needle, sizeof(escaped_needle));
+        chunked_printf(cw,
+                       "<html><head><title>Search in %s</title><style>"
+                       "body{font-family: monospace; font-size: 13px;}"
+                       "td {padding: 1.5px 6px;}"
+                       "</style></head><body><h1>Search for &quot;%s&quot; in %s</h1><hr><table>\n",
+                       escaped_dir, escaped_needle, escaped_dir);
+    }
+
+    size_t emitted = 0;
+    for (size_t i = 0; i < n && !cw->failed; i++) {
+        dir_entry e = { .is_dir = dirs[i] };
+        if (!dir_fill_stat(dfd, &e, names + offs[i]))
+            continue;
+        dir_emit_row(cw, &e, names + offs[i], icon_style, json, emitted++ == 0);
+    }
+
+    if (json) {
+        chunked_printf(cw, "],\"more\":%s}", more ? "true" : "false");
+    } else {
+        chunked_printf(cw, "</table><hr>");
+        url_encode(needle, buf, sizeof(buf));
+        if (offset > 0)
+            chunked_printf(cw, "<a href=\"?search=%s&offset=%zu&limit=%zu\">&laquo; prev</a> ",
+                           buf, offset > limit ? offset - limit : 0, limit);
+        if (more)
+            chunked_printf(cw, "<a href=\"?search=%s&offset=%zu&limit=%zu\">next &raquo;</a>",
+                           buf, offset + limit, limit);
+        chunked_printf(cw, "</body></html>");
+    }
+    chunked_end(cw);
+
+    close(dfd);
+    free(ids); free(offs); free(dirs); free(cw); free(names);
+    return 200;
+}
+
+// Moves n bytes (n < 0: until EOF) from rp to dst without copying them
+// through userspace: whatever rp has already buffered is written out first,
+// the rest goes socket -> pipe -> dst with splice. dst_off is the file
+// offset to write at, or NULL for sockets. pipefd is created on first use
+// and owned by the caller. Returns the number of bytes that reached dst.
+CW_HOT off_t splice_body(rio_t *rp, int dst, loff_t *dst_off, off_t n, int pipefd[2]) {
+    bool to_eof = n < 0;
+    off_t moved = 0;
+
+    if (rp->rio_cnt > 0) {
+        size_t len = rp->rio_cnt;
+        if (!to_eof && (off_t)len > n)
+            len = n;
+        if (dst_off) {
+            for (size_t done = 0; done < len; ) {
+                ssize_t w = pwrite(dst, rp->rio_bufptr + done, len - done, *dst_off);
+                if (w < 0 && errno == EINTR)
+                    continue;
+                if (w <= 0)
+                    return moved;
+                done += w;
+                moved += w;
+                *dst_off += w;
+            }
+        } else {
+            if (writen(dst, rp->rio_bufptr, len) < 0)
+                return moved;
+            moved += len;
+        }
+        rp->rio_bufptr += len;
+        rp->rio_cnt -= len;
+    }
+
+    if (pipefd[0] < 0 && (to_eof || moved < n) && pipe2(pipefd, O_CLOEXEC) < 0) {
+        log_error("pipe2 failed: %s\n", strerror(errno));
+        return moved;
+    }
+    while (to_eof || moved < n) {
+        size_t want = SPLICE_CHUNK;
+        if (!to_eof && n - moved < (off_t)want)
+            want = n - moved;
+        ssize_t in = splice(rp->rio_fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR)
+            continue;
+        if (in <= 0) {
+            if (in < 0)
+                log_error("splice from fd %d failed: %s\n", rp->rio_fd, strerror(errno));
+            break;
+        }
+        while (in > 0) {
+            ssize_t out = splice(pipefd[0], NULL, dst, dst_off, in, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR)
+                continue;
+            if (out <= 0) {
+                log_error("splice to fd %d failed: %s\n", dst, strerror(errno));
+                return moved; // The pipe still holds data, callers drop it with the request
+            }
+            in -= out;
+            moved += out;
+        }
+    }
+    return moved;
+}
+
+static void pipe_close(int pipefd[2]) {
+    if (pipefd[0] >= 0) {
+        close(pipefd[0]);
+        close(pipefd[1]);
+        pipefd[0] = pipefd[1] = -1;
+    }
+}
+
+// host:port, [v6]:port or unix:/path
+static int proxy_parse_upstream(const char *spec, proxy_upstream *up) {
+    memset(up, 0, sizeof(*up));
+    pthread_mutex_init(&up->lock, NULL);
+    snprintf(up->name, sizeof(up->name), "%s", spec);
+
+    if (strncmp(spec, "unix:", 5) == 0) {
+        struct sockaddr_un *sun = (struct sockaddr_un *)&up->addr;
+        if (strlen(spec + 5) == 0 || strlen(spec + 5) >= sizeof(sun->sun_path))
+            return -1;
+        sun->sun_family = AF_UNIX;
+        strcpy(sun->sun_path, spec + 5);
+        up->addrlen = sizeof(*sun);
+        return 0;
+    }
+
+    char host[128];
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || !colon[1] || (size_t)(colon - spec) >= sizeof(host))
+        return -1;
+    memcpy(host, spec, colon - spec);
+    host[colon - spec] = '\0';
+    if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+        memmove(host, host + 1, strlen(host));
+        host[strlen(host) - 1] = '\0';
+    }
+
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(host, colon + 1, &hints, &res);
+    if (rc != 0) {
+        log_error("Upstream %s: %s\n", spec, gai_strerror(rc));
+        return -1;
+    }
+    memcpy(&up->addr, res->ai_addr, res->ai_addrlen);
+    up->addrlen = res->ai_addrlen;
+    freeaddrinfo(res);
+    return 0;
+}
+
+// prefix=upstream[,upstream...], e.g. /api/=127.0.0.1:9000,unix:/run/api.sock
+int proxy_add_route(const char *spec) {
+    char buf[MAXLINE];
+    const char *eq = strchr(spec, '=');
+
+    if (proxy_route_count == PROXY_MAX_ROUTES || !eq) {
+        log_error("Bad proxy route '%s' (at most %d of prefix=upstream[,upstream...])\n", spec, PROXY_MAX_ROUTES);
+        return -1;
+    }
+    proxy_route *route = &proxy_routes[proxy_route_count];
+    memset(route, 0, sizeof(*route));
+
+    const char *p = spec, *end = eq;
+    while (p < end && *p == '/')
+        p++;
+    while (end > p && end[-1] == '/')
+        end--;
+    if ((size_t)(end - p) >= sizeof(route->prefix))
+        return -1;
+    memcpy(route->prefix, p, end - p);
+    route->prefix[end - p] = '\0';
+    route->prefix_len = end - p;
+
+    snprintf(buf, sizeof(buf), "%s", eq + 1);
+    for (char *save, *tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (route->count == PROXY_MAX_UPSTREAMS || proxy_parse_upstream(tok, &route->upstreams[route->count]) < 0) {
+            log_error("Bad upstream '%s' in proxy route '%s'\n", tok, spec);
+            return -1;
+        }
+        route->count++;
+    }
+    if (route->count == 0) {
+        log_error("Proxy route '%s' has no upstreams\n", spec);
+        return -1;
+    }
+    proxy_route_count++;
+    return 0;
+}
+
+// Whole path segments only: "api" matches api and api/x but not apis
+proxy_route *proxy_match(const char *path) {
+    for (int i = 0; i < proxy_route_count; i++) {
+        proxy_route *route = &proxy_routes[i];
+        if (route->prefix_len == 0 ||
+            (strncmp(path, route->prefix, route->prefix_len) == 0 &&
+             (path[route->prefix_len] == '\0' || path[route->prefix_len] == '/')))
+            return route;
+    }
+    return NULL;
+}
+
+static void proxy_mark(proxy_upstream *up, bool ok) {
+    pthread_mutex_lock(&up->lock);
+    if (ok) {
+        if (up->fails >= PROXY_FAIL_THRESHOLD)
+            log_message("Upstream %s is back\n", up->name);
+        up->fails = 0;
+        up->down_until = 0;
+    } else if (++up->fails >= PROXY_FAIL_THRESHOLD) {
+        up->down_until = time(NULL) + PROXY_RETRY_AFTER;
+        log_error("Upstream %s marked down for %d s after %d failures\n", up->name, PROXY_RETRY_AFTER, up->fails);
+    }
+    pthread_mutex_unlock(&up->lock);
+}
+
+// Round robin over healthy upstreams not tried yet for this request. When
+// all of them are down the one due for a retry first is used anyway.
+static proxy_upstream *proxy_pick(proxy_route *route, unsigned *tried) {
+    time_t now = time(NULL);
+    unsigned start = __sync_fetch_and_add(&route->next, 1);
+    int fallback = -1;
+
+    for (int i = 0; i < route->count; i++) {
+        int k = (start + i) % route->count;
+        proxy_upstream *up = &route->upstreams[k];
+        if (*tried & (1u << k))
+            continue;
+        pthread_mutex_lock(&up->lock);
+        time_t down_until = up->down_until;
+        pthread_mutex_unlock(&up->lock);
+        if (down_until <= now) {
+            *tried |= 1u << k;
+            return up;
+        }
+        if (fallback < 0 || down_until < route->upstreams[fallback].down_until)
+            fallback = k;
+    }
+    if (fallback < 0)
+        return NULL;
+    *tried |= 1u << fallback;
+    return &route->upstreams[fallback];
+}
+
+static int proxy_connect(proxy_upstream *up) {
+    struct timeval tv = { PROXY_IO_TIMEOUT, 0 };
+    int err = 0, one = 1;
+    socklen_t errlen = sizeof(err);
+
+    int ufd = socket(up->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ufd < 0)
+        return -1;
+    if (connect(ufd, (SA *)&up->addr, up->addrlen) < 0) {
+        struct pollfd pfd = { ufd, POLLOUT, 0 };
+        if (errno != EINPROGRESS) {
+            err = errno;
+        } else if (poll(&pfd, 1, PROXY_CONNECT_TIMEOUT) != 1) {
+            err = ETIMEDOUT;
+        } else if (getsockopt(ufd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0) {
+            err = errno;
+        }
+    }
+    if (err) {
+        log_error("Upstream %s: connect failed: %s\n", up->name, strerror(err));
+        close(ufd);
+        return -1;
+    }
+    fcntl(ufd, F_SETFL, fcntl(ufd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(ufd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(ufd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    if (up->addr.ss_family != AF_UNIX)
+        setsockopt(ufd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return ufd;
+}
+
+// Pooled connections that became readable while idle were closed by the
+// upstream (or sent something unsolicited) and are dropped
+static int proxy_acquire(proxy_upstream *up, bool *reused) {
+    for (;;) {
+        int ufd = -1;
+        pthread_mutex_lock(&up->lock);
+        if (up->idle_count > 0)
+            ufd = up->idle[--up->idle_count];
+        pthread_mutex_unlock(&up->lock);
+        if (ufd < 0)
+            break;
+        struct pollfd pfd = { ufd, POLLIN, 0 };
+        if (poll(&pfd, 1, 0) == 0) {
+            *reused = true;
+            return ufd;
+        }
+        close(ufd);
+    }
+    *reused = false;
+    return proxy_connect(up);
+}
+
+static void proxy_release(proxy_upstream *up, int ufd, bool reusable) {
+    pthread_mutex_lock(&up->lock);
+    if (reusable && up->idle_count < PROXY_POOL_SIZE) {
+        up->idle[up->idle_count++] = ufd;
+        ufd = -1;
+    }
+    pthread_mutex_unlock(&up->lock);
+    if (ufd >= 0)
+        close(ufd);
+}
+
+static bool is_hop_header(const char *line) {
+    static const char *hop[] = {
+        "Connection:", "Keep-Alive:", "Proxy-Connection:", "TE:", "Trailer:",
+        "Upgrade:", "Expect:", NULL
+    };
+    for (int i = 0; hop[i]; i++) {
+        if (strncasecmp(line, hop[i], strlen(hop[i])) == 0)
+            return true;
+    }
+    return false;
+}
+
+// Request line and headers for the upstream: hop-by-hop headers are
+// dropped, X-Forwarded-For is extended and the connection is kept alive
+static int proxy_build_head(http_request *req, struct sockaddr_in *clientaddr, proxy_upstream *up,
+                            char *out, size_t outsz) {
+    const char *forwarded = "";
+    int forwarded_len = 0;
+    bool has_host = false;
+    size_t len = snprintf(out, outsz, "%s %s HTTP/1.1\r\n", req->method, req->uri);
+
+    for (const char *line = req->headers; *line; ) {
+        const char *next = strchr(line, '\n');
+        next = next ? next + 1 : line + strlen(line);
+        if (strncasecmp(line, "X-Forwarded-For:", 16) == 0) {
+            forwarded = line + 16 + strspn(line + 16, " \t");
+            forwarded_len = strcspn(forwarded, "\r\n");
+        } else if (!is_hop_header(line)) {
+            has_host = has_host || strncasecmp(line, "Host:", 5) == 0;
+            if (len + (next - line) >= outsz)
+                return -1;
+            memcpy(out + len, line, next - line);
+            len += next - line;
+        }
+        line = next;
+    }
+    if (len < outsz)
+        len += snprintf(out + len, outsz - len, "X-Forwarded-For: %.*s%s%s\r\n", forwarded_len, forwarded,
+                        forwarded_len ? ", " : "", inet_ntoa(clientaddr->sin_addr));
+    if (!has_host && len < outsz)
+        len += snprintf(out + len, outsz - len, "Host: %s\r\n",
+                        up->addr.ss_family == AF_UNIX ? "localhost" : up->name);
+    if (len < outsz)
+        len += snprintf(out + len, outsz - len, "Connection: keep-alive\r\n\r\n");
+    return len < outsz ? (int)len : -1;
+}
+
+// Relays a chunked body as is, following the framing to find its end
+static bool proxy_relay_chunked(rio_t *up, int fd, int pipefd[2]) {
+    char line[MAXLINE];
+    ssize_t n;
+
+    for (;;) {
+        char *endp;
+        if ((n = rio_readlineb(up, line, sizeof(line))) <= 0)
+            return false;
+        off_t size = strtoll(line, &endp, 16);
+        if (endp == line || size < 0 || writen(fd, line, n) < 0)
+            return false;
+        if (size == 0)
+            break;
+        off_t moved = splice_body(up, fd, NULL, size, pipefd);
+        flight_add_bytes(moved);
+        if (moved != size)
+            return false;
+        if ((n = rio_readlineb(up, line, sizeof(line))) <= 0 || writen(fd, line, n) < 0) // CRLF after the data
+            return false;
+    }
+    do { // Trailer section up to the empty line
+        if ((n = rio_readlineb(up, line, sizeof(line))) <= 0 || writen(fd, line, n) < 0)
+            return false;
+    } while (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0);
+    return true;
+}
+
+#define PROXY_FAILED  (-1) // Nothing was sent to the client, another upstream may be tried
+#define PROXY_TIMEOUT (-2)
+
+// Reads the upstream response and passes it to the client. Returns the
+// upstream status, or PROXY_FAILED/PROXY_TIMEOUT if the response never
+// started. *reusable is set when the upstream connection can be pooled.
+static int proxy_relay_response(int fd, int ufd, http_request *req, int pipefd[2], bool *reusable) {
+    rio_t up;
+    char line[MAXLINE], head[MAXLINE * 2];
+    size_t hlen = 0;
+    ssize_t n;
+    int major = 0, minor = 0, status = 0;
+    long long clen = -1;
+    bool chunked = false, keep_alive = true;
+
+    *reusable = false;
+    rio_readinitb(&up, ufd);
+
+    for (;;) { // Interim 1xx responses are consumed here
+        if ((n = rio_readlineb(&up, line, sizeof(line))) <= 0)
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? PROXY_TIMEOUT : PROXY_FAILED;
+        if (sscanf(line, "HTTP/%d.%d %d", &major, &minor, &status) != 3 || status < 100 || status > 999)
+            return PROXY_FAILED;
+        hlen = snprintf(head, sizeof(head), "%s", line);
+        clen = -1;
+        chunked = false;
+        keep_alive = major > 1 || (major == 1 && minor >= 1);
+        while ((n = rio_readlineb(&up, line, sizeof(line))) > 0) {
+            if (strcmp(line, "\r\n") == 0 || strcmp(line, "\n") == 0)
+                break;
+            if (strncasecmp(line, "Content-Length:", 15) == 0) {
+                clen = strtoll(line + 15, NULL, 10);
+            } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+                chunked = header_has_token(line + 18, "chunked");
+            } else if (strncasecmp(line, "Connection:", 11) == 0) {
+                if (header_has_token(line + 11, "close"))
+                    keep_alive = false;
+                else if (header_has_token(line + 11, "keep-alive"))
+                    keep_alive = true;
+            }
+            if (is_hop_header(line))
+                continue;
+            if (hlen + n >= sizeof(head)) { // Flush long header blocks as they come
+                if (writen(fd, head, hlen) < 0)
+                    return status;
+                hlen = 0;
+            }
+            memcpy(head + hlen, line, n);
+            hlen += n;
+        }
+        if (n <= 0)
+            return PROXY_FAILED;
+        if (status >= 200)
+            break;
+    }
+
+    // The client connection is closed after every response
+    if (hlen + 32 >= sizeof(head)) {
+        if (writen(fd, head, hlen) < 0)
+            return status;
+        hlen = 0;
     }
-    *q = '\0';
+    hlen += snprintf(head + hlen, sizeof(head) - hlen, "Connection: close\r\n\r\n");
+    if (writen(fd, head, hlen) < 0)
+        return status;
+
+    bool complete;
+    if (strcmp(req->method, "HEAD") == 0 || status == 204 || status == 304) {
+        complete = true;
+    } else if (chunked) {
+        complete = proxy_relay_chunked(&up, fd, pipefd);
+    } else if (clen >= 0) {
+        off_t moved = splice_body(&up, fd, NULL, clen, pipefd);
+        flight_add_bytes(moved);
+        complete = moved == clen;
+    } else { // Delimited by the upstream closing the connection
+        flight_add_bytes(splice_body(&up, fd, NULL, -1, pipefd));
+        complete = keep_alive = false;
+    }
+    *reusable = complete && keep_alive && up.rio_cnt == 0;
+    return status;
 }
 
-void parse_request(int fd, http_request *req) {
-    rio_t rio;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE];
-    req->offset = 0;
-    req->end = 0;
-
-    rio_readinitb(&rio, fd);
+// Sends the request head. *sent is set once the upstream socket took any
+// of it: from then on the upstream may act on the request.
+static bool proxy_send_head(int ufd, const char *head, size_t len, bool *sent) {
+    ssize_t n;
+
+    while ((n = write(ufd, head, len)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return false;
+    *sent = true;
+    return (size_t)n == len || writen(ufd, head + n, len - n) >= 0;
+}
 
-    if (rio_readlineb(&rio, buf, MAXLINE) <= 0) {
-        log_error("Failed to read request line\n");
-        return;
+// Forwards req to the route's upstreams. Failures move on to the next
+// upstream while nothing of the request reached an upstream, or, for GET,
+// HEAD and OPTIONS, as long as the request body has not been consumed.
+// Other methods are never sent twice: a POST that an upstream may have
+// acted on ends in 502/504. A pooled connection the upstream closed
+// meanwhile says nothing about its health, so under the same rules that
+// upstream is retried once on a fresh connection first.
+int proxy_request(int fd, struct sockaddr_in *clientaddr, http_request *req, proxy_route *route) {
+    struct timeval tv = { PROXY_IO_TIMEOUT, 0 };
+    char head[MAXLINE * 2];
+    int pipefd[2] = { -1, -1 };
+    int status = PROXY_FAILED;
+    unsigned tried = 0;
+    bool head_sent = false, body_sent = false;
+    bool replayable = strcmp(req->method, "GET") == 0 || strcmp(req->method, "HEAD") == 0 ||
+                      strcmp(req->method, "OPTIONS") == 0;
+    proxy_upstream *retry = NULL; // Its pooled connection went stale
+
+    if (req->headers_overflow) {
+        client_error(fd, 431, "Request Header Fields Too Large", "Request headers are too large to forward");
+        return 431;
     }
-
-    if (sscanf(buf, "%s %s", method, uri) != 2) {
-        log_error("Failed to parse request line: %s\n", buf);
-        return;
+    if (req->chunked) {
+        client_error(fd, 411, "Length Required", "Chunked request bodies are not supported, send Content-Length");
+        return 411;
     }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    printf("parse_request: Original URI = '%s'\n", uri); // **ОТЛАДОЧНАЯ ПЕЧАТЬ (перед url_decode)**
+    for (int attempt = 0; attempt < route->count && !body_sent && (replayable || !head_sent); attempt++) {
+        proxy_upstream *up = retry ? retry : proxy_pick(route, &tried);
+        bool reused = false, reusable;
+        int len, ufd;
 
-    char* filename = uri;
-    if (uri[0] == '/') {
-        filename = uri + 1;
-        int length = strlen(filename);
-        if (length == 0) {
-            filename = ".";
-        } else {
-            for (int i = 0; i < length; ++i) {
-                if (filename[i] == '?') {
-                    filename[i] = '\0';
-                    break;
-                }
+        if (!up)
+            break;
+        ufd = retry ? proxy_connect(up) : proxy_acquire(up, &reused);
+        retry = NULL;
+        if (ufd < 0) {
+            proxy_mark(up, false);
+            continue;
+        }
+        flight_stage(STAGE_RESOLVE);
+
+        if ((len = proxy_build_head(req, clientaddr, up, head, sizeof(head))) < 0) {
+            proxy_release(up, ufd, reused);
+            client_error(fd, 431, "Request Header Fields Too Large", "Request headers are too large to forward");
+            return 431;
+        }
+        if (!proxy_send_head(ufd, head, len, &head_sent)) {
+            log_error("Upstream %s: write failed: %s\n", up->name, strerror(errno));
+            close(ufd);
+            if (reused) {
+                retry = up;
+                attempt--;
+            } else {
+                proxy_mark(up, false);
+            }
+            continue;
+        }
+        if (req->content_length > 0) {
+            body_sent = true; // Whatever happens next, the body cannot be replayed
+            if (req->expect_continue)
+                writen(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+            if (splice_body(&req->rio, ufd, NULL, req->content_length, pipefd) != req->content_length) {
+                close(ufd);
+                pipe_close(pipefd);
+                client_error(fd, 502, "Bad Gateway", "Request body could not be forwarded");
+                return 502;
             }
         }
+
+        status = proxy_relay_response(fd, ufd, req, pipefd, &reusable);
+        if (status > 0) {
+            proxy_mark(up, true);
+            proxy_release(up, ufd, reusable);
+            flight_stage(STAGE_SEND);
+            break;
+        }
+        log_error("Upstream %s: %s\n", up->name, status == PROXY_TIMEOUT ? "response timed out" : "no valid response");
+        close(ufd);
+        if (reused && status == PROXY_FAILED) {
+            retry = up; // Used only if the loop goes on
+            attempt--;
+        } else {
+            proxy_mark(up, false);
+        }
     }
+    pipe_close(pipefd);
 
-    url_decode(filename, req->filename, sizeof(req->filename));
-    printf("parse_request: Decoded filename = '%s'\n", req->filename); // **ОТЛАДОЧНАЯ ПЕЧАТЬ (после url_decode)**
+    if (status == PROXY_TIMEOUT) {
+        client_error(fd, 504, "Gateway Timeout", "Upstream did not respond in time");
+        return 504;
+    }
+    if (status < 0) {
+        client_error(fd, 502, "Bad Gateway", "No upstream available");
+        return 502;
+    }
+    return status;
 }
 
-
-void client_error(int fd, int status, const char *msg, const char *longmsg) {
+static void upload_reply(int fd, int status, const char *reason, const char *headers, const char *body) {
     char buf[MAXLINE];
-    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n", status, msg);
-    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-length: %lu\r\n", strlen(longmsg));
-    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-type: text/plain\r\n\r\n");
-    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "%s", longmsg);
+    snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n%sContent-Length: %zu\r\nContent-Type: text/plain\r\n\r\n%s",
+             status, reason, headers, strlen(body), body);
     writen(fd, buf, strlen(buf));
 }
 
-bool is_video_mime_type(const char *mime_type) {
-    return strncmp(mime_type, "video/", 6) == 0;
+// "Range: bytes=0-N" for the bytes of a partial upload already stored
+static void upload_progress(int fd, int status, const char *reason, off_t received) {
+    char hdr[64] = "";
+    if (received > 0)
+        snprintf(hdr, sizeof(hdr), "Range: bytes=0-%lld\r\n", (long long)received - 1);
+    upload_reply(fd, status, reason, hdr, status == 202 ? "Upload incomplete\n" : "Upload offset mismatch\n");
 }
 
-bool is_audio_mime_type(const char *mime_type) {
-    return strncmp(mime_type, "audio/", 6) == 0;
+static bool upload_body(http_request *req, int out, off_t at) {
+    int pipefd[2] = { -1, -1 };
+    loff_t off = at;
+    off_t moved = splice_body(&req->rio, out, &off, req->content_length, pipefd);
+
+    pipe_close(pipefd);
+    flight_add_bytes(moved);
+    flight_stage(STAGE_SEND);
+    if (moved != req->content_length) {
+        log_error("Upload of %s stopped after %lld of %lld bytes\n", req->filename,
+                  (long long)moved, req->content_length);
+        return false;
+    }
+    return true;
 }
 
-// Обслуговування статичного файлу
-void serve_static(int out_fd, const char *filename, http_request *req, size_t total_size, bool is_ftp_mode) { // is_ftp_mode is present for consistency
-    char buf[MAXLINE];
-    int in_fd;
-    const char *mime_type;
+// Transfer-Encoding: chunked body into out. The chunk data moves with
+// splice like upload_body; only the size lines and trailers are read.
+// Returns the body length, -1 if it is malformed or cut off, -2 once it
+// grows past upload_max.
+static off_t upload_dechunk(http_request *req, int out) {
+    char line[MAXLINE];
+    int pipefd[2] = { -1, -1 };
+    loff_t off = 0;
+    off_t result = -1;
+    ssize_t n;
+
+    while ((n = rio_readlineb(&req->rio, line, sizeof(line))) > 0 && line[n - 1] == '\n') {
+        char *endp;
+        unsigned long long size = strtoull(line, &endp, 16); // Overflow saturates and fails the limit
+        if (!isxdigit((unsigned char)line[0]) || !strchr(";\r\n \t", *endp))
+            break;
+        if (size == 0) { // Trailer fields up to the empty line are dropped
+            while ((n = rio_readlineb(&req->rio, line, sizeof(line))) > 0 &&
+                   strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0)
+                ;
+            if (n > 0)
+                result = off;
+            break;
+        }
+        if (size > (unsigned long long)(upload_max - off)) {
+            result = -2;
+            break;
+        }
+        if (splice_body(&req->rio, out, &off, size, pipefd) != (off_t)size)
+            break;
+        n = rio_readlineb(&req->rio, line, sizeof(line));
+        if (n <= 0 || (strcmp(line, "\r\n") != 0 && strcmp(line, "\n") != 0))
+            break;
+    }
+    pipe_close(pipefd);
+    flight_add_bytes(off);
+    flight_stage(STAGE_SEND);
+    if (result == -1)
+        log_error("Chunked upload of %s stopped after %lld bytes\n", req->filename, (long long)off);
+    return result;
+}
 
-    char resolved_path[PATH_MAX];
-    if (realpath(filename, resolved_path) == NULL) { // Розв'язання відносного шляху в абсолютний
-        client_error(out_fd, 403, "Forbidden", "Invalid path"); // Помилка: недійсний шлях
+// A rejected upload may still be on its way. Closing with unread data
+// resets the connection and can destroy the reply, so the body is read
+// and dropped for a short while after the reply went out.
+static void upload_linger(int fd, http_request *req) {
+    struct timeval tv = { UPLOAD_LINGER_TIME, 0 };
+    char buf[RIO_BUFSIZE];
+    size_t dropped = 0;
+    ssize_t n;
+
+    if (req->content_length <= 0 && !req->chunked)
         return;
+    shutdown(fd, SHUT_WR);
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    req->rio.rio_cnt = 0;
+    while (dropped < UPLOAD_LINGER_MAX && (n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno != EINTR)
+            break;
+        if (n > 0)
+            dropped += n;
     }
+}
 
-    if (strncmp(resolved_path, "/tmp", strlen("/tmp")) != 0) { // Перевірка, чи шлях не виходить за межі /tmp (безпека)
-        client_error(out_fd, 403, "Forbidden", "Access denied"); // Помилка доступу: шлях за межами /tmp
-        return;
+// Reserves the space up front; file systems without fallocate just skip it
+static int upload_reserve(int out, int mode, off_t len) {
+    if (len > 0 && fallocate(out, mode, 0, len) < 0) {
+        if (errno == ENOSPC || errno == EDQUOT)
+            return -1;
+        if (errno != EOPNOTSUPP && errno != ENOSYS)
+            log_error("fallocate failed: %s\n", strerror(errno));
     }
+    return 0;
+}
 
-    in_fd = open(filename, O_RDONLY, 0); // Відкриття файлу для читання
-    if (in_fd < 0) {
-        client_error(out_fd, 404, "Not found", "File not found"); // Помилка: файл не знайдено
+// Removes part files in dir that nothing was written to for
+// UPLOAD_PART_MAX_AGE, left by clients that never came back. Runs when a
+// resumable upload starts in dir. Parts locked by an upload are kept.
+static void upload_sweep(const char *dir) {
+    time_t now = time(NULL);
+    struct dirent *dp;
+    struct stat st;
+
+    DIR *d = opendir(dir);
+    if (!d)
         return;
+    while ((dp = readdir(d)) != NULL) {
+        size_t len = strlen(dp->d_name);
+        if (dp->d_name[0] != '.' || len < 7 || strcmp(dp->d_name + len - 5, ".part") != 0)
+            continue;
+        int part = openat(dirfd(d), dp->d_name, O_WRONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+        if (part < 0)
+            continue;
+        if (fstat(part, &st) == 0 && S_ISREG(st.st_mode) && now - st.st_mtime > UPLOAD_PART_MAX_AGE &&
+            flock(part, LOCK_EX | LOCK_NB) == 0) {
+            log_message("Removing stale partial upload %s/%s\n", dir, dp->d_name);
+            unlinkat(dirfd(d), dp->d_name, 0);
+        }
+        close(part);
     }
+    closedir(d);
+}
 
-    mime_type = get_mime_type(filename); // Get mime type here, as it's needed in both modes - Отримання MIME-типу тут, оскільки він потрібен в обох режимах
-
-    // In this version, is_ftp_mode is not actually used in serve_static
-    if (is_ftp_mode) { // This block is present but doesn't change behavior in this version
-        if (is_video_mime_type(mime_type)) {
-            snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nContent-Type: text/html\r\n\r\n");
-            writen(out_fd, buf, strlen(buf));
+static int upload_commit(int fd, int out, const char *from, const char *to) {
+    struct stat st;
+    bool existed = lstat(to, &st) == 0;
 
-            char video_html[MAXLINE * 4];
-            snprintf(video_html, sizeof(video_html),
-                     "<!DOCTYPE html><html><head><title>Video Player</title><style>"
-                     "body { font-family: sans-serif; text-align: center; }"
-                     "h1 { font-size: 1.2em; color: #666; }"
-                     "#video-container { display: inline-block; }"
-                     "</style></head><body>"
-                     "<div id=\"video-container\">"
-                     "<h1>Playing: %s</h1>"
-                     "<video width=\"640\" height=\"480\" controls>"
-                     "<source src=\"/%s\" type=\"%s\">"
-                     "Your browser does not support the video tag."
-                     "</video>"
-                     "</div></body></html>",
-                     filename, filename, mime_type);
+    if (fsync(out) < 0 || fchmod(out, 0644) < 0 || rename(from, to) < 0) {
+        log_error("Cannot store upload %s: %s\n", to, strerror(errno));
+        unlink(from);
+        upload_reply(fd, 500, "Internal Server Error", "", "Upload could not be stored\n");
+        return 500;
+    }
+    upload_reply(fd, existed ? 200 : 201, existed ? "OK" : "Created", "", "Stored\n");
+    return existed ? 200 : 201;
+}
 
-            writen(out_fd, video_html, strlen(video_html));
-            close(in_fd);
-            return;
+// Uploads in the protected view: PUT or POST to /prefix/dir/name stores
+// name, POST to a directory takes the name from ?name=. Bodies move
+// socket -> pipe -> file with splice into a preallocated temp file that is
+// renamed over the target once complete. A chunked body of unknown length
+// is de-chunked into the temp file without preallocation, and refused with
+// 413 once it passes the limit. With Content-Range: bytes a-b/total
+// the file arrives in pieces through .name.total.part, which survives dropped
+// connections; "bytes */total" with an empty body asks how much is stored.
+// Pieces declaring another total than the stored part are refused with 409.
+int serve_upload(int fd, http_request *req) {
+    char dir[PATH_MAX], name[NAME_MAX + 1], resolved[PATH_MAX];
+    char target[PATH_MAX], tmp[PATH_MAX];
+    struct timeval tv = { UPLOAD_IO_TIMEOUT, 0 };
+    struct stat st;
+    int out, status;
+
+    if (upload_max == 0) {
+        upload_reply(fd, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n", "Uploads are disabled\n");
+        return 405;
+    }
+    if (req->has_content_range && req->cr_first < 0 && req->content_length < 0 && !req->chunked)
+        req->content_length = 0; // A progress query needs no Content-Length
+    if (req->chunked ? req->has_content_range : req->content_length < 0) {
+        upload_reply(fd, 411, "Length Required", "", req->chunked ? "Resumable pieces need Content-Length\n" :
+                     "Content-Length or chunked encoding is required\n");
+        return 411;
+    }
 
-        } else {
-            goto serve_file_static;
+    // Split the target into its directory and file name
+    size_t len;
+    snprintf(dir, sizeof(dir), "%s", req->filename);
+    if (stat(dir, &st) == 0 && S_ISDIR(st.st_mode)) {
+        if (!get_query_param(req->query, "name", name, sizeof(name))) {
+            upload_reply(fd, 400, "Bad Request", "", "Uploading to a directory needs ?name=\n");
+            return 400;
         }
-
-
+        len = strlen(name); // One too long for the buffer arrives cut at NAME_MAX, still too long below
     } else {
-        goto serve_file_static;
+        char *slash = strrchr(dir, '/');
+        const char *base = slash ? slash + 1 : dir;
+        len = strlen(base);
+        if (len <= NAME_MAX - 32)
+            memcpy(name, base, len + 1);
+        if (slash)
+            *slash = '\0';
+        else
+            strcpy(dir, ".");
+    }
+    // Room for the ".name.XXXXXX" and ".name.total.part" temp names. Refused,
+    // not shortened: a cut name would store the upload as another file.
+    if (len > NAME_MAX - 32) {
+        upload_reply(fd, 414, "URI Too Long", "", "File name too long\n");
+        return 414;
+    }
+    if (name[0] == '\0' || name[0] == '.' || strchr(name, '/')) {
+        upload_reply(fd, 400, "Bad Request", "", "Invalid file name\n");
+        return 400;
+    }
+    if (realpath(dir, resolved) == NULL || !path_is_allowed(resolved) ||
+        stat(dir, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        upload_reply(fd, 403, "Forbidden", "", "Upload directory is not accessible\n");
+        return 403;
+    }
+    snprintf(target, sizeof(target), "%s/%s", dir, name);
+    if (stat(target, &st) == 0 && S_ISDIR(st.st_mode)) {
+        upload_reply(fd, 409, "Conflict", "", "Target is a directory\n");
+        return 409;
     }
 
-
-serve_file_static:
-     if (req->offset > 0) {
-            snprintf(buf, sizeof(buf), "HTTP/1.1 206 Partial Content\r\n");
-            snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Range: bytes %lu-%lu/%lu\r\n",
-                     req->offset, req->end - 1, total_size);
-        } else {
-            snprintf(buf, sizeof(buf), "HTTP/1.1 200 OK\r\nAccept-Ranges: bytes\r\n");
+    long long total = req->has_content_range ? req->cr_total : req->content_length;
+    if (total > upload_max) {
+        upload_reply(fd, 413, "Payload Too Large", "", "Upload exceeds the size limit\n");
+        return 413;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    flight_stage(STAGE_RESOLVE);
+
+    if (!req->has_content_range) {
+        snprintf(tmp, sizeof(tmp), "%s/.%s.XXXXXX", dir, name);
+        if ((out = mkostemp(tmp, O_CLOEXEC)) < 0) {
+            upload_reply(fd, 500, "Internal Server Error", "", "Cannot create temporary file\n");
+            return 500;
         }
-        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Cache-Control: no-cache\r\n");
-        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Length: %lu\r\n",
-                 req->end - req->offset);
-        snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), "Content-Type: %s\r\n\r\n",
-                 mime_type);
-
-        writen(out_fd, buf, strlen(buf));
-
-        off_t offset = req->offset;
-        ssize_t sf_result;
-        while (offset < req->end) {
-            size_t bytes_to_send = req->end - offset;
-            sf_result = sendfile(out_fd, in_fd, &offset, bytes_to_send);
-
-            if (sf_result <= 0) {
-                if (errno == EINTR) continue;
-                if (errno == EPIPE) {
-                    log_message("Client disconnected prematurely (Broken pipe)\n");
-                    break;
-                }
-                log_error("sendfile error: %s\n", strerror(errno));
-                break;
+        off_t got = 0;
+        if (!req->chunked && upload_reserve(out, 0, req->content_length) < 0) {
+            status = 507;
+            upload_reply(fd, status, "Insufficient Storage", "", "Not enough space for the upload\n");
+        } else {
+            if (req->expect_continue)
+                writen(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+            if (req->chunked && (got = upload_dechunk(req, out)) == -2) {
+                status = 413;
+                upload_reply(fd, status, "Payload Too Large", "", "Upload exceeds the size limit\n");
+            } else if (req->chunked ? got < 0 : !upload_body(req, out, 0)) {
+                status = 400;
+                upload_reply(fd, status, "Bad Request", "", "Upload body incomplete\n");
+            } else {
+                status = upload_commit(fd, out, tmp, target);
             }
         }
+        if (status != 200 && status != 201)
+            unlink(tmp);
+        close(out);
+        return status;
+    }
 
+    // Resumable upload: the part file's size is the number of bytes stored
+    // (space for the rest is reserved with FALLOC_FL_KEEP_SIZE). The total
+    // is part of its name, so a piece for another total finds no part.
+    snprintf(tmp, sizeof(tmp), "%s/.%s.%lld.part", dir, name, total);
+    if (req->cr_first < 0) {
+        if (req->content_length != 0) {
+            upload_reply(fd, 400, "Bad Request", "", "Progress queries have no body\n");
+            return 400;
+        }
+        upload_progress(fd, 202, "Accepted", stat(tmp, &st) == 0 ? st.st_size : 0);
+        return 202;
+    }
+    if (req->cr_last - req->cr_first + 1 != req->content_length || req->cr_last >= total) {
+        upload_reply(fd, 400, "Bad Request", "", "Content-Range does not match Content-Length\n");
+        return 400;
+    }
+    if (req->cr_first == 0)
+        upload_sweep(dir);
+    out = open(tmp, O_WRONLY | O_CLOEXEC | (req->cr_first == 0 ? O_CREAT : 0), 0600);
+    if (out < 0) {
+        upload_progress(fd, 409, "Conflict", 0); // Also when the total differs from the stored part's
+        return 409;
+    }
+    if (flock(out, LOCK_EX | LOCK_NB) < 0) {
+        close(out);
+        upload_reply(fd, 409, "Conflict", "", "Another upload of this file is in progress\n");
+        return 409;
+    }
+    if (req->cr_first == 0) { // (Re)start
+        if (ftruncate(out, 0) < 0 || upload_reserve(out, FALLOC_FL_KEEP_SIZE, total) < 0) {
+            close(out);
+            unlink(tmp);
+            upload_reply(fd, 507, "Insufficient Storage", "", "Not enough space for the upload\n");
+            return 507;
+        }
+    }
+    off_t stored = fstat(out, &st) == 0 ? st.st_size : -1;
+    if (stored != req->cr_first) {
+        close(out);
+        upload_progress(fd, 409, "Conflict", stored);
+        return 409;
+    }
 
-    close(in_fd);
+    if (req->expect_continue)
+        writen(fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+    bool complete = upload_body(req, out, req->cr_first);
+    stored = fstat(out, &st) == 0 ? st.st_size : 0;
+    if (complete && stored == total) {
+        status = upload_commit(fd, out, tmp, target);
+    } else {
+        status = 202;
+        upload_progress(fd, status, "Accepted", stored); // Short pieces are kept, the client resumes
+    }
+    close(out);
+    return status;
 }
 
-void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
+CW_HOT void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
     printf("process: icon_style = %s\n", icon_style);
     printf("accept request, fd is %d, pid is %d\n", fd, getpid());
     bool is_ftp_mode = false; // Initialize is_ftp_mode here
 
     http_request req; // Declare req here
-    parse_request(fd, &req);
+    bool parsed = parse_request(fd, &req);
+    flight_stage(STAGE_READ);
+    if (!parsed) {
+        client_error(fd, 400, "Bad Request", "Malformed request");
+        log_access(400, clientaddr, &req);
+        return;
+    }
+
+    proxy_route *route = proxy_match(req.filename);
+    if (route) {
+        log_access(proxy_request(fd, clientaddr, &req, route), clientaddr, &req);
+        return;
+    }
 
     if (strlen(pftp_path_prefix) > 0) {
         printf("process: pftp_path_prefix = '%s', length = %lu\n", pftp_path_prefix, strlen(pftp_path_prefix)); // **ОТЛАДОЧНАЯ ПЕЧАТЬ**
@@ -646,6 +4952,33 @@ void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
         strcpy(req.filename, ".");
     }
 
+    if (is_ftp_mode && (strcmp(req.method, "PUT") == 0 || strcmp(req.method, "POST") == 0)) {
+        status = serve_upload(fd, &req);
+        log_access(status, clientaddr, &req);
+        if (status >= 400)
+            upload_linger(fd, &req);
+        return;
+    }
+
+    // Manifest mode: answer misses and plain files without touching the filesystem
+    // (the protected view keeps its video player page, so videos take the usual path)
+    manifest_entry me;
+    int found = manifest_lookup(req.filename, &me);
+    if (found >= 0)
+        flight_stage(STAGE_RESOLVE);
+    if (found == 0) {
+        status = 404;
+        client_error(fd, status, "Not found", "File not found");
+        log_access(status, clientaddr, &req);
+        return;
+    }
+    if (found == 1 && !(me.flags & MF_DIR) &&
+        !(is_ftp_mode && me.mime < MIME_TYPES_COUNT && is_video_mime_type(meme_types[me.mime].mime_type))) {
+        status = serve_manifest_file(fd, &req, &me);
+        log_access(status, clientaddr, &req);
+        return;
+    }
+
     ffd = open(req.filename, O_RDONLY, 0);
     if (ffd <= 0) {
         status = 404;
@@ -653,12 +4986,27 @@ void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
         client_error(fd, status, "Not found", msg);
     } else {
         fstat(ffd, &sbuf);
+        flight_stage(STAGE_RESOLVE);
 
         if (S_ISDIR(sbuf.st_mode)) {
             if (is_ftp_mode) { // This block is present, behavior will be modified in later steps
+                char archive[8], needle[256];
                 close(ffd);
                 status = 200;
-                handle_directory_request(fd, req.filename, icon_style);
+                if (get_query_param(req.query, "archive", archive, sizeof(archive))) {
+                    status = serve_archive(fd, req.filename, &req, archive);
+                } else if (get_query_param(req.query, "search", needle, sizeof(needle)) && needle[0]) {
+                    if (search_enabled) {
+                        status = serve_search(fd, req.filename, icon_style, req.query, needle, req.http10);
+                    } else {
+                        status = 501;
+                        client_error(fd, status, "Not Implemented", "Search is not enabled on this server");
+                    }
+                    flight_stage(STAGE_DIRLIST);
+                } else {
+                    handle_directory_request(fd, req.filename, icon_style, req.query, req.http10);
+                    flight_stage(STAGE_DIRLIST);
+                }
                 log_access(status, clientaddr, &req);
                 return;
             } else { // Standard HTTP directory handling path - **MODIFIED for Variant 2**
@@ -679,22 +5027,16 @@ void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
                 }
                 fstat(ffd, &sbuf);
 
-                if (req.end == 0) {
-                    req.end = sbuf.st_size;
-                }
-                if (req.offset > 0) {
-                    status = 206;
+                status = resolve_range(fd, &req, sbuf.st_size);
+                if (status != 416) {
+                    serve_static(fd, index_path, &req, sbuf.st_size, is_ftp_mode); // is_ftp_mode is passed
                 }
-                serve_static(fd, index_path, &req, sbuf.st_size, is_ftp_mode); // is_ftp_mode is passed
             }
         } else if (S_ISREG(sbuf.st_mode)) { // Standard HTTP file serving path
-            if (req.end == 0) {
-                req.end = sbuf.st_size;
+            status = resolve_range(fd, &req, sbuf.st_size);
+            if (status != 416) {
+                serve_static(fd, req.filename, &req, sbuf.st_size, is_ftp_mode); // is_ftp_mode is passed
             }
-            if (req.offset > 0) {
-                status = 206;
-            }
-            serve_static(fd, req.filename, &req, sbuf.st_size, is_ftp_mode); // is_ftp_mode is passed
         } else {
             status = 400;
             char *msg = "Unknown Error";
@@ -707,8 +5049,9 @@ void process(int fd, struct sockaddr_in *clientaddr, const char *icon_style) {
 }
 
 
-void *connection_handler(void *socket_desc) {
-    int sock = *(int*)socket_desc;
+CW_HOT void *connection_handler(void *arg) {
+    connection_job *job = arg;
+    int sock = job->fd;
     struct sockaddr_in clientaddr;
     socklen_t clientlen = sizeof(clientaddr);
     const char *icon_style = icon_style_str;
@@ -718,17 +5061,28 @@ void *connection_handler(void *socket_desc) {
     if (getpeername(sock, (SA *)&clientaddr, &clientlen) == -1) {
         perror("getpeername");
         log_error("Failed to get client address\n");
+        close(sock);
+        free(job);
+        __sync_fetch_and_sub(&connections_active, 1);
         return NULL;
     }
 
     printf("Handling connection in thread, fd is %d, icon style: %s\n", sock, icon_style);
+    connection_slot_moved = false;
+    CW_PROBE1(request__start, sock);
+    flight_begin(&clientaddr, job->accepted);
     process(sock, &clientaddr, icon_style);
+    flight_finish();
+    free(job);
+    // Released before the close: a client that sees it may connect again at
+    // once, and the thread has nothing left to do but exit
+    if (!connection_slot_moved)
+        __sync_fetch_and_sub(&connections_active, 1);
     close(sock);
-    free(socket_desc);
     return NULL;
 }
 
-void daemonize_process() {
+CW_COLD void daemonize_process() {
     pid_t pid = fork();
 
     if (pid < 0) {
@@ -762,8 +5116,9 @@ void daemonize_process() {
     umask(0);
 }
 
-void usage(char *program_name) {
-    fprintf(stderr, "Usage: %s [-p port] [-w web_root] [-d] [-h] [-v] [-i icon_style] [-f ftp_password]\n", program_name);
+CW_COLD void usage(char *program_name) {
+    fprintf(stderr, "Usage: %s [-p port] [-w web_root] [-d] [-h] [-v] [-i icon_style] [-f ftp_password] [-m manifest] [-T slow_ms] [-L slow_log]\n"
+                    "       [-P prefix=upstream[,upstream...]] [-s] [-u max_upload]\n", program_name);
     fprintf(stderr, "  -p port      Specify the port to listen on (default: 8080)\n");
     fprintf(stderr, "  -w web_root  Specify the web root directory (default: .)\n");
     fprintf(stderr, "  -d           Run in daemon mode\n");
@@ -772,6 +5127,15 @@ void usage(char *program_name) {
     fprintf(stderr, "  -i icon_style Specify icon style for directory listing (default: text)\n");
     fprintf(stderr, "                 Possible values: text, emoji, none\n");
     fprintf(stderr, "  -f ftp_password Enable pseudo-FTP mode with password-based path prefix\n"); // Added -f option description
+    fprintf(stderr, "  -m manifest  Serve metadata from a manifest built by cwindex\n");
+    fprintf(stderr, "  -T slow_ms   Record requests slower than slow_ms, SIGUSR1 dumps the last %d\n", FLIGHT_RING_SIZE);
+    fprintf(stderr, "  -L slow_log  Also append slow requests to slow_log as they finish\n");
+    fprintf(stderr, "  -P prefix=upstream[,upstream...]\n");
+    fprintf(stderr, "               Forward requests under prefix to host:port or unix:/path upstreams\n");
+    fprintf(stderr, "               (repeatable, up to %d prefixes of %d upstreams)\n", PROXY_MAX_ROUTES, PROXY_MAX_UPSTREAMS);
+    fprintf(stderr, "  -s           Index file names for ?search= in the protected directory view\n");
+    fprintf(stderr, "  -u max_upload Allow PUT/POST uploads up to max_upload bytes (K/M/G suffix)\n");
+    fprintf(stderr, "               in the protected directory view\n");
     exit(EXIT_FAILURE);
 }
 
@@ -782,15 +5146,214 @@ void print_version() {
     printf("\n");
     printf("Designed for serving static content with concurrent connection handling via POSIX threads.\n");
     printf("Primarily intended for educational use.\n");
+    printf("\nBuild: %s profile, %d byte request buffers, max connections %d (0: unlimited), thread stack %d KB (0: default)\n",
+#ifdef CW_TINY
+           "tiny",
+#else
+           "default",
+#endif
+           MAXLINE, CW_MAX_CONNECTIONS, CW_THREAD_STACK / 1024);
     exit(EXIT_SUCCESS);
 }
 
+#ifdef CW_INDEXER
+// cwindex: offline builder for the web-root manifest (make cwindex)
+
+#define INDEX_MAX_DEPTH 256
+
+static manifest_entry *index_entries = NULL;
+static size_t index_count = 0, index_cap = 0;
+static char *index_names = NULL;
+static size_t index_names_len = 0, index_names_cap = 0;
+
+static int index_cmp(const void *a, const void *b) {
+    return strcmp(index_names + ((const manifest_entry *)a)->path_off,
+                  index_names + ((const manifest_entry *)b)->path_off);
+}
+
+static const manifest_entry *index_find(const char *path) {
+    size_t lo = 0, hi = index_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strcmp(index_names + index_entries[mid].path_off, path);
+        if (c == 0)
+            return &index_entries[mid];
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
+}
+
+static bool index_add(const char *path, const struct stat *st) {
+    size_t len = strlen(path) + 1;
+
+    if (len > UINT16_MAX || index_names_len + len > UINT32_MAX)
+        return false;
+    if (index_count == index_cap) {
+        size_t ncap = index_cap ? index_cap * 2 : 4096;
+        manifest_entry *tmp = realloc(index_entries, ncap * sizeof(manifest_entry));
+        if (!tmp) return false;
+        index_entries = tmp;
+        index_cap = ncap;
+    }
+    if (index_names_len + len > index_names_cap) {
+        size_t ncap = index_names_cap ? index_names_cap * 2 : 65536;
+        while (ncap < index_names_len + len) ncap *= 2;
+        char *tmp = realloc(index_names, ncap);
+        if (!tmp) return false;
+        index_names = tmp;
+        index_names_cap = ncap;
+    }
+
+    manifest_entry *e = &index_entries[index_count++];
+    manifest_fill(path, st, e);
+    e->path_off = index_names_len;
+    e->path_len = len - 1;
+    memcpy(index_names + index_names_len, path, len);
+    index_names_len += len;
+    return true;
+}
+
+// Follows symlinks like the server does; the ancestor stack stops loops
+static void index_walk(const char *dir, int depth, dev_t *devs, ino_t *inos) {
+    char path[PATH_MAX];
+    struct dirent *dp;
+    struct stat st;
+
+    DIR *d = opendir(dir);
+    if (!d) {
+        log_error("opendir(%s) failed: %s\n", dir, strerror(errno));
+        return;
+    }
+    while ((dp = readdir(d)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, ".."))
+            continue;
+        if (fstatat(dirfd(d), dp->d_name, &st, 0) < 0 || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode)))
+            continue;
+        if (!tree_watch_join(path, sizeof(path), dir, dp->d_name)) {
+            log_message("Skipping %s/%s: path too long\n", dir, dp->d_name);
+            continue;
+        }
+
+        bool loop = false;
+        for (int i = 0; i <= depth && S_ISDIR(st.st_mode); i++)
+            loop = loop || (devs[i] == st.st_dev && inos[i] == st.st_ino);
+        if (loop) {
+            log_message("Skipping directory loop at %s\n", path);
+            continue;
+        }
+        if (!index_add(path, &st)) {
+            log_error("Cannot index %s: out of memory or path too long\n", path);
+            continue;
+        }
+        if (S_ISDIR(st.st_mode) && depth + 1 < INDEX_MAX_DEPTH) {
+            devs[depth + 1] = st.st_dev;
+            inos[depth + 1] = st.st_ino;
+            index_walk(path, depth + 1, devs, inos);
+        }
+    }
+    closedir(d);
+}
+
+static CW_COLD void index_usage(const char *program_name) {
+    fprintf(stderr, "Usage: %s [-w web_root] [-o manifest_file]\n", program_name);
+    fprintf(stderr, "  -w web_root      Web root to index (default: .)\n");
+    fprintf(stderr, "  -o manifest_file Output file (default: cwserver.manifest)\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv) {
+    char web_root[MAXLINE] = ".", output[MAXLINE] = "cwserver.manifest";
+    char out_path[PATH_MAX + MAXLINE], tmp_path[PATH_MAX + MAXLINE + 8], cwd[PATH_MAX];
+    dev_t devs[INDEX_MAX_DEPTH];
+    ino_t inos[INDEX_MAX_DEPTH];
+    struct stat st;
+    int option_char;
+
+    while ((option_char = getopt(argc, argv, "w:o:h")) != -1) {
+        switch (option_char) {
+        case 'w':
+            snprintf(web_root, sizeof(web_root), "%s", optarg);
+            break;
+        case 'o':
+            snprintf(output, sizeof(output), "%s", optarg);
+            break;
+        default:
+            index_usage(argv[0]);
+        }
+    }
+
+    // The output path is relative to where we were started, not to the web root
+    if (output[0] != '/' && getcwd(cwd, sizeof(cwd)))
+        snprintf(out_path, sizeof(out_path), "%s/%s", cwd, output);
+    else
+        snprintf(out_path, sizeof(out_path), "%s", output);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", out_path);
+
+    if (chdir(web_root) != 0 || stat(".", &st) != 0) {
+        perror(web_root);
+        exit(EXIT_FAILURE);
+    }
+    time_t built = time(NULL);
+    devs[0] = st.st_dev;
+    inos[0] = st.st_ino;
+    index_add(".", &st);
+    index_walk(".", 0, devs, inos);
+    qsort(index_entries, index_count, sizeof(manifest_entry), index_cmp);
+
+    // Precompressed siblings are looked up in the sorted table, not on disk
+    for (size_t i = 0; i < index_count; i++) {
+        char variant[PATH_MAX + 3];
+        const manifest_entry *v;
+        if (index_entries[i].flags & MF_DIR)
+            continue;
+        snprintf(variant, sizeof(variant), "%s.gz", index_names + index_entries[i].path_off);
+        if ((v = index_find(variant)) && !(v->flags & MF_DIR))
+            index_entries[i].flags |= MF_GZIP;
+        snprintf(variant, sizeof(variant), "%s.br", index_names + index_entries[i].path_off);
+        if ((v = index_find(variant)) && !(v->flags & MF_DIR))
+            index_entries[i].flags |= MF_BROTLI;
+    }
+
+    manifest_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = MANIFEST_MAGIC;
+    hdr.version = MANIFEST_VERSION;
+    hdr.count = index_count;
+    hdr.entry_size = sizeof(manifest_entry);
+    hdr.strings_off = sizeof(hdr) + index_count * sizeof(manifest_entry);
+    hdr.strings_len = index_names_len;
+    hdr.built = built;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 ||
+        writen(fd, &hdr, sizeof(hdr)) < 0 ||
+        writen(fd, index_entries, index_count * sizeof(manifest_entry)) < 0 ||
+        writen(fd, index_names, index_names_len) < 0 ||
+        fsync(fd) < 0 || close(fd) < 0 ||
+        rename(tmp_path, out_path) < 0) {
+        log_error("Cannot write %s: %s\n", out_path, strerror(errno));
+        unlink(tmp_path);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("Indexed %zu entries (%zu bytes of paths) into %s\n", index_count, index_names_len, out_path);
+    return 0;
+}
+
+#else
+
 int main(int argc, char** argv) {
-    int listenfd, connfd, *new_sock;
+    int listenfd, connfd;
+    connection_job *job;
     socklen_t clientlen;
     struct sockaddr_in clientaddr;
     char port[MAXLINE];
     char web_root[MAXLINE];
+    char manifest_file[MAXLINE] = "";
+    char slow_log_file[MAXLINE] = "";
     pthread_t thread_id;
     int daemonize = 0;
     int option_char; // For getopt
@@ -799,7 +5362,7 @@ int main(int argc, char** argv) {
     snprintf(web_root, MAXLINE, ".");
     snprintf(icon_style_str, MAXLINE, default_icon_style);
 
-    while ((option_char = getopt(argc, argv, "p:w:dhvi:f:")) != -1) {
+    while ((option_char = getopt(argc, argv, "p:w:dhvi:f:m:T:L:P:su:")) != -1) {
         switch (option_char) {
         case 'p':
             strncpy(port, optarg, MAXLINE - 1);
@@ -828,6 +5391,34 @@ int main(int argc, char** argv) {
             snprintf(pftp_path_prefix, MAXLINE, "/%s/", ftp_password); // Construct pftp_path_prefix
             printf("Debug: Pseudo-FTP password set, path prefix: %s\n", pftp_path_prefix); // Debug print
             break;
+        case 'm':
+            strncpy(manifest_file, optarg, MAXLINE - 1);
+            manifest_file[MAXLINE - 1] = '\0';
+            break;
+        case 'T':
+            flight_threshold_ns = (uint64_t)(strtod(optarg, NULL) * 1e6);
+            break;
+        case 'L':
+            strncpy(slow_log_file, optarg, MAXLINE - 1);
+            slow_log_file[MAXLINE - 1] = '\0';
+            break;
+        case 'P':
+            if (proxy_add_route(optarg) < 0)
+                exit(EXIT_FAILURE);
+            break;
+        case 's':
+            search_enabled = true;
+            break;
+        case 'u': { // Size with an optional K/M/G suffix
+            char *endp;
+            upload_max = strtoll(optarg, &endp, 10);
+            if (*endp == 'K' || *endp == 'k') upload_max <<= 10;
+            else if (*endp == 'M' || *endp == 'm') upload_max <<= 20;
+            else if (*endp == 'G' || *endp == 'g') upload_max <<= 30;
+            if (upload_max <= 0)
+                usage(argv[0]);
+            break;
+        }
         default:
             usage(argv[0]);
         }
@@ -835,6 +5426,21 @@ int main(int argc, char** argv) {
 
     printf("main: icon_style_str = %s\n", icon_style_str);
 
+    if (manifest_file[0] && manifest_open(manifest_file) < 0) { // Relative to the starting directory
+        exit(EXIT_FAILURE);
+    }
+
+    if (slow_log_file[0]) { // Also relative to the starting directory
+        if (!flight_threshold_ns) {
+            log_error("-L needs a slow request threshold (-T ms)\n");
+            exit(EXIT_FAILURE);
+        }
+        if (!(flight_log = fopen(slow_log_file, "a"))) {
+            perror(slow_log_file);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     if (chdir(web_root) != 0) {
         perror(web_root);
         exit(EXIT_FAILURE);
@@ -854,18 +5460,55 @@ int main(int argc, char** argv) {
 
     signal(SIGPIPE, SIG_IGN);
 
+    if (CW_THREAD_STACK > 0) {
+        thread_attr_init();
+    }
+
+    if (flight_threshold_ns) {
+        flight_recorder_start();
+    }
+
+    if (stream_engine_start() < 0) {
+        log_error("Streaming engine unavailable, large files will be sent inline\n");
+    }
+
+    if (manifest.enabled) {
+        manifest_watch_start();
+    }
+
+    if (search_enabled && search_start() < 0) {
+        log_error("Search index unavailable\n");
+        search_enabled = false;
+    }
+
     while ((connfd = accept(listenfd, (SA *)&clientaddr, &clientlen))) {
         if (connfd < 0) {
             perror("accept");
             continue;
         }
 
-        new_sock = malloc(sizeof(int));
-        *new_sock = connfd;
+        if (__sync_add_and_fetch(&connections_active, 1) > CW_MAX_CONNECTIONS && CW_MAX_CONNECTIONS > 0) {
+            __sync_fetch_and_sub(&connections_active, 1);
+            client_error(connfd, 503, "Service Unavailable", "Too many connections, try again later");
+            close(connfd);
+            continue;
+        }
 
-        if (pthread_create(&thread_id, NULL, connection_handler, (void*)new_sock) < 0) {
-            perror("could not create thread");
-            free(new_sock);
+        if ((job = malloc(sizeof(*job))) == NULL) {
+            __sync_fetch_and_sub(&connections_active, 1);
+            client_error(connfd, 503, "Service Unavailable", "Out of memory, try again later");
+            close(connfd);
+            continue;
+        }
+        job->fd = connfd;
+        job->accepted = flight_threshold_ns ? flight_now() : 0;
+
+        int err = pthread_create(&thread_id, thread_attr, connection_handler, job);
+        if (err != 0) { // Returns the error number, errno is left alone
+            log_error("could not create thread: %s\n", strerror(err));
+            __sync_fetch_and_sub(&connections_active, 1);
+            free(job);
+            client_error(connfd, 503, "Service Unavailable", "Too many connections, try again later");
             close(connfd);
             continue;
         }
@@ -878,4 +5521,6 @@ int main(int argc, char** argv) {
     return 0;
 }
 
+#endif /* CW_INDEXER */
+
 
@@ -0,0 +1,96 @@
+#!/bin/sh
+# archivetest.sh - folder download check for cwserver (?archive=)
+#
+# Builds a small web root, starts cwserver with the protected directory
+# view and checks resumed tar and zip downloads:
+#   etag      the archive carries an ETag that stays put while the tree does
+#   resume    a Range with a matching If-Range gives 206 and the same bytes
+#             as the full archive
+#   changed   after a file changes the ETag differs, and a Range with the
+#             old one in If-Range gives the whole new archive with 200
+#   date      an If-Range date never matches, the answer is a full 200
+# Exits 1 on the first failed check. Needs curl and cmp.
+#
+#   make archivetest
+#   sh tools/archivetest.sh ./cwserver-host
+#
+# Settings (environment):
+#   PORT            Listen port (default 18195)
+
+SERVER=${1:-./cwserver-host}
+PORT=${PORT:-18195}
+PID=
+
+die() {
+    echo "archivetest: $*" >&2
+    [ -n "$ROOT" ] && [ -f "$ROOT.log" ] && sed 's/^/  server: /' "$ROOT.log" | tail -20 >&2
+    exit 1
+}
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+    [ -n "$ROOT" ] && rm -rf "$ROOT" "$ROOT.log" "$ROOT.out"
+}
+
+# fetch FORMAT FILE [CURL ARGS...]: body to FILE, prints "status etag"
+fetch() {
+    format=$1 file=$2
+    shift 2
+    curl -s -m 10 -D "$ROOT.out" -o "$file" "$@" "http://127.0.0.1:$PORT/pw/data/?archive=$format" ||
+        die "$format: request failed"
+    status=$(sed -n '1s/^HTTP\/1\.1 \([0-9]*\).*/\1/p' "$ROOT.out")
+    etag=$(tr -d '\r' < "$ROOT.out" | sed -n 's/^ETag: //p')
+    echo "$status $etag"
+}
+
+[ -x "$SERVER" ] || die "$SERVER: not executable (make cwserver-host)"
+command -v curl > /dev/null || die "curl not found"
+
+# The web root has to be below ALLOWED_ROOT_PREFIX, /tmp by default
+ROOT=$(mktemp -d /tmp/cwarchive.XXXXXX) || die "mktemp failed"
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p "$ROOT/www/data/sub" "$ROOT/get"
+head -c 300000 /dev/urandom > "$ROOT/www/data/a.bin"
+head -c 70000 /dev/urandom > "$ROOT/www/data/sub/b.bin"
+echo "hello" > "$ROOT/www/data/sub/c.txt"
+
+"$SERVER" -p "$PORT" -w "$ROOT/www" -f pw > /dev/null 2> "$ROOT.log" &
+PID=$!
+sleep 1
+kill -0 "$PID" 2>/dev/null || die "server did not start"
+
+for format in tar zip; do
+    full=$ROOT/get/full.$format
+    set -- $(fetch $format "$full")
+    [ "$1" = 200 ] || die "etag: $format answered $1, expected 200"
+    [ -n "$2" ] || die "etag: $format archive has no ETag"
+    tag=$2
+    set -- $(fetch $format "$ROOT/get/again")
+    [ "$2" = "$tag" ] || die "etag: $format ETag changed from $tag to $2 on an unchanged tree"
+    echo "archivetest: $format etag ok"
+
+    set -- $(fetch $format "$ROOT/get/tail" -r 1000- -H "If-Range: $tag")
+    [ "$1" = 206 ] || die "resume: $format answered $1, expected 206"
+    tail -c +1001 "$full" | cmp -s - "$ROOT/get/tail" || die "resume: $format tail differs from the full archive"
+    echo "archivetest: $format resume ok"
+
+    set -- $(fetch $format "$ROOT/get/date" -r 1000- -H "If-Range: Mon, 01 Jan 2024 00:00:00 GMT")
+    [ "$1" = 200 ] || die "date: $format answered $1, expected 200"
+    echo "archivetest: $format date ok"
+done
+
+sleep 1.1 # A new mtime second as well, in case the file system has no finer stamps
+head -c 300000 /dev/urandom > "$ROOT/www/data/a.bin"
+for format in tar zip; do
+    set -- $(fetch $format "$ROOT/get/old")
+    old=$2
+    echo "x" >> "$ROOT/www/data/sub/c.txt"
+    set -- $(fetch $format "$ROOT/get/new" -r 1000- -H "If-Range: $old")
+    [ "$1" = 200 ] || die "changed: $format answered $1 with a stale If-Range, expected 200"
+    [ "$2" != "$old" ] || die "changed: $format ETag $old did not change with the tree"
+    set -- $(fetch $format "$ROOT/get/check")
+    cmp -s "$ROOT/get/new" "$ROOT/get/check" || die "changed: $format 200 answer is not the whole new archive"
+    echo "archivetest: $format changed ok"
+done
@@ -0,0 +1,200 @@
+// cwload - fixed-concurrency HTTP load generator for tools/footprint.sh
+//
+// Each of -c workers opens a connection, sends one GET and reads the reply
+// until the server closes it (cWServer serves one request per connection),
+// for -d seconds. Prints one line of key=value results on stdout.
+//
+//   cwload -c 8 -d 5 -p 8080 / /big.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define MAX_WORKERS 1024
+
+typedef struct {
+    int id;
+    unsigned long requests;
+    unsigned long errors;
+    unsigned long long bytes;
+    uint32_t *lat_us;       // Latency of every successful request
+    size_t lat_count, lat_cap;
+} worker;
+
+static struct sockaddr_in target;
+static char **paths;
+static int path_count;
+static int io_timeout = 10;
+static volatile int running = 1;
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// One request on a fresh connection. Returns the bytes received, -1 on error.
+static long long do_request(const char *path) {
+    char buf[16384];
+    struct timeval tv = { io_timeout, 0 };
+    struct linger lg = { 1, 0 }; // Reset on close, keeps TIME_WAIT off the client ports
+    long long total = 0;
+    ssize_t n;
+    int fd, len;
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    if (connect(fd, (struct sockaddr *)&target, sizeof(target)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+                   path, inet_ntoa(target.sin_addr));
+    if (write(fd, buf, len) != len) {
+        close(fd);
+        return -1;
+    }
+
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        if (total == 0 && (n < 12 || strncmp(buf, "HTTP/1.", 7) != 0 || buf[9] != '2')) {
+            close(fd);
+            return -1; // Only 2xx counts as served
+        }
+        total += n;
+    }
+    close(fd);
+    return n < 0 || total == 0 ? -1 : total;
+}
+
+static void *worker_thread(void *arg) {
+    worker *w = arg;
+    unsigned long i = w->id;
+
+    while (running) {
+        uint64_t start = now_us();
+        long long got = do_request(paths[i++ % path_count]);
+        uint64_t took = now_us() - start;
+
+        if (!running && got < 0)
+            break; // Cut off by the end of the run
+        w->requests++;
+        if (got < 0) {
+            w->errors++;
+            continue;
+        }
+        w->bytes += got;
+        if (w->lat_count == w->lat_cap) {
+            size_t cap = w->lat_cap ? w->lat_cap * 2 : 4096;
+            uint32_t *lat = realloc(w->lat_us, cap * sizeof(*lat));
+            if (!lat)
+                continue;
+            w->lat_us = lat;
+            w->lat_cap = cap;
+        }
+        w->lat_us[w->lat_count++] = took > UINT32_MAX ? UINT32_MAX : (uint32_t)took;
+    }
+    return NULL;
+}
+
+static int cmp_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_ms(const uint32_t *lat, size_t n, double p) {
+    if (n == 0)
+        return 0;
+    size_t i = (size_t)(p * (n - 1) + 0.5);
+    return lat[i] / 1000.0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-c concurrency] [-d seconds] [-h host] [-p port] [-t io_timeout] path...\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int concurrency = 1, seconds = 5, opt;
+    const char *host = "127.0.0.1";
+    int port = 8080;
+
+    while ((opt = getopt(argc, argv, "c:d:h:p:t:")) != -1) {
+        switch (opt) {
+        case 'c': concurrency = atoi(optarg); break;
+        case 'd': seconds = atoi(optarg); break;
+        case 'h': host = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 't': io_timeout = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || concurrency < 1 || concurrency > MAX_WORKERS || seconds < 1)
+        usage(argv[0]);
+    paths = argv + optind;
+    path_count = argc - optind;
+
+    memset(&target, 0, sizeof(target));
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &target.sin_addr) != 1) {
+        fprintf(stderr, "%s: not an IPv4 address\n", host);
+        return 1;
+    }
+
+    worker *workers = calloc(concurrency, sizeof(worker));
+    pthread_t *tids = calloc(concurrency, sizeof(pthread_t));
+    if (!workers || !tids)
+        return 1;
+
+    uint64_t start = now_us();
+    for (int i = 0; i < concurrency; i++) {
+        workers[i].id = i;
+        if (pthread_create(&tids[i], NULL, worker_thread, &workers[i]) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            return 1;
+        }
+    }
+    sleep(seconds);
+    running = 0;
+    for (int i = 0; i < concurrency; i++)
+        pthread_join(tids[i], NULL);
+    double elapsed = (now_us() - start) / 1e6;
+
+    unsigned long requests = 0, errors = 0;
+    unsigned long long bytes = 0;
+    size_t n = 0;
+    for (int i = 0; i < concurrency; i++) {
+        requests += workers[i].requests;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+        n += workers[i].lat_count;
+    }
+    uint32_t *lat = malloc((n ? n : 1) * sizeof(*lat));
+    if (!lat)
+        return 1;
+    for (int i = 0, k = 0; i < concurrency; i++) {
+        memcpy(lat + k, workers[i].lat_us, workers[i].lat_count * sizeof(*lat));
+        k += workers[i].lat_count;
+    }
+    qsort(lat, n, sizeof(*lat), cmp_u32);
+
+    printf("concurrency=%d requests=%lu errors=%lu rps=%.0f mbps=%.1f p50_ms=%.2f p99_ms=%.2f max_ms=%.2f\n",
+           concurrency, requests, errors, n / elapsed, bytes * 8 / elapsed / 1e6,
+           percentile_ms(lat, n, 0.50), percentile_ms(lat, n, 0.99), n ? lat[n - 1] / 1000.0 : 0);
+    return 0;
+}
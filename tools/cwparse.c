@@ -0,0 +1,448 @@
+// cwparse - fuzz driver and microbenchmark for the request parser
+//
+// Builds the server source into the same unit (its main is renamed), so the
+// static parse_uri/parse_request are exercised exactly as the server runs them.
+//
+//   cwparse fuzz [iterations] [seed]   differential fuzzing, exits 1 on the first mismatch
+//   cwparse bench [ms_per_case]        ns per call and MB/s for typical and hostile targets
+//
+// Built with -DCW_LIBFUZZER it is a libFuzzer target instead:
+//   clang -fsanitize=fuzzer,address -DCW_LIBFUZZER -D_GNU_SOURCE tools/cwparse.c -lresolv -pthread
+
+#define main cwserver_main
+#include "../cwserver_v0.1a.c"
+#undef main
+
+#define FUZZ_PATHSZ 256 // Small enough that over-long targets are common
+
+static FILE *report;    // stderr before the server's output was silenced
+static uint64_t rng_state;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static size_t rng_below(size_t n) {
+    return n ? rng() % n : 0;
+}
+
+// Reference for parse_uri, written for obviousness instead of speed: decode
+// the whole path first, then resolve segments on a stack
+static int ref_parse_uri(const char *uri, char *path, size_t pathsz, char *query, size_t querysz) {
+    size_t plen = strcspn(uri, "?#"), n = 0, top = 0;
+    char *dec = malloc(plen + 1);
+    size_t *starts = malloc((plen + 1) * sizeof(size_t)), *lens = malloc((plen + 1) * sizeof(size_t));
+    int rc = -1;
+
+    if (uri[0] != '/' || pathsz < 2 || !dec || !starts || !lens)
+        goto out;
+
+    query[0] = '\0';
+    if (uri[plen] == '?') {
+        size_t qlen = strcspn(uri + plen + 1, "#");
+        if (qlen > querysz - 1)
+            qlen = querysz - 1;
+        memcpy(query, uri + plen + 1, qlen);
+        query[qlen] = '\0';
+    }
+
+    for (size_t i = 1; i < plen; i++) {
+        unsigned char c = uri[i];
+        if (c == '%') {
+            if (!isxdigit((unsigned char)uri[i + 1]) || !isxdigit((unsigned char)uri[i + 2]))
+                goto out;
+            char hex[3] = { uri[i + 1], uri[i + 2], 0 };
+            c = (unsigned char)strtol(hex, NULL, 16);
+            if (c == 0)
+                goto out;
+            i += 2;
+        }
+        if (c < 0x20 || c == 0x7f)
+            goto out;
+        dec[n++] = c;
+    }
+    dec[n] = '\0';
+    if (n + 2 >= pathsz)
+        goto out; // Caller only compares targets that fit
+
+    size_t seg = 0;
+    bool last_named = false;
+    for (size_t i = 0; i <= n; i++) {
+        if (i < n && dec[i] != '/')
+            continue;
+        size_t len = i - seg;
+        last_named = false;
+        if (len == 0 || (len == 1 && dec[seg] == '.')) {
+            // Dropped
+        } else if (len == 2 && dec[seg] == '.' && dec[seg + 1] == '.') {
+            if (top == 0)
+                goto out;
+            top--;
+        } else {
+            starts[top] = seg;
+            lens[top++] = len;
+            last_named = i == n;
+        }
+        seg = i + 1;
+    }
+
+    size_t q = 0;
+    for (size_t k = 0; k < top; k++) {
+        memcpy(path + q, dec + starts[k], lens[k]);
+        q += lens[k];
+        if (k + 1 < top || !last_named)
+            path[q++] = '/';
+    }
+    if (q == 0)
+        path[q++] = '.';
+    path[q] = '\0';
+    rc = 0;
+out:
+    free(dec);
+    free(starts);
+    free(lens);
+    return rc;
+}
+
+static size_t decoded_len(const char *uri) {
+    size_t plen = strcspn(uri, "?#"), n = 0;
+    for (size_t i = 1; i < plen; i++, n++)
+        if (uri[i] == '%' && isxdigit((unsigned char)uri[i + 1]) && isxdigit((unsigned char)uri[i + 2]))
+            i += 2;
+    return n;
+}
+
+static void fail(const char *what, const char *input, size_t len) {
+    fprintf(report, "cwparse: %s\ninput (%zu bytes):", what, len);
+    for (size_t i = 0; i < len && i < 512; i++)
+        fprintf(report, isprint((unsigned char)input[i]) && input[i] != '\\' ? "%c" : "\\x%02x", (unsigned char)input[i]);
+    fprintf(report, "\n");
+    exit(1);
+}
+
+// Result must not hold anything parse_uri promises to remove
+static bool path_is_clean(const char *path) {
+    if (strcmp(path, ".") == 0)
+        return true;
+    if (path[0] == '/' || strstr(path, "//"))
+        return false;
+    for (const char *p = path; *p; p++)
+        if ((unsigned char)*p < 0x20 || *p == 0x7f)
+            return false;
+    for (const char *seg = path; *seg; ) {
+        size_t len = strcspn(seg, "/");
+        if ((len == 1 && seg[0] == '.') || (len == 2 && seg[0] == '.' && seg[1] == '.'))
+            return false;
+        seg += len + (seg[len] == '/');
+    }
+    return true;
+}
+
+static void check_uri(const char *uri, size_t pathsz) {
+    char *path = malloc(pathsz), *ref = malloc(pathsz); // Exact sizes so ASan sees any overrun
+    char *query = malloc(64), *ref_query = malloc(64);
+    int rc = parse_uri(uri, path, pathsz, query, 64);
+
+    if (rc == 0) {
+        if (strlen(path) >= pathsz || strlen(query) >= 64)
+            fail("parse_uri result does not fit its buffer", uri, strlen(uri));
+        if (!path_is_clean(path))
+            fail("parse_uri left a control byte, '//', '.' or '..' in the path", uri, strlen(uri));
+    }
+    if (decoded_len(uri) + 2 < pathsz) { // Near the limit parse_uri may refuse early, which is fine
+        int ref_rc = ref_parse_uri(uri, ref, pathsz, ref_query, 64);
+        if (rc != ref_rc)
+            fail(rc ? "parse_uri rejected a valid target" : "parse_uri accepted an invalid target", uri, strlen(uri));
+        if (rc == 0 && (strcmp(path, ref) != 0 || strcmp(query, ref_query) != 0)) {
+            fprintf(report, "got \"%s\" ? \"%s\", expected \"%s\" ? \"%s\"\n", path, query, ref, ref_query);
+            fail("parse_uri differs from the reference", uri, strlen(uri));
+        }
+    }
+    free(path); free(ref); free(query); free(ref_query);
+}
+
+// Fixed cases: traversal, encodings, control bytes, collapsing, length
+static const struct {
+    const char *uri;
+    const char *path; // NULL: must be rejected
+} uri_cases[] = {
+    { "/", "." },
+    { "/index.html", "index.html" },
+    { "/a/b/", "a/b/" },
+    { "//a///b", "a/b" },
+    { "/a/./b/.", "a/b/" },
+    { "/a/b/../c", "a/c" },
+    { "/a/..", "." },
+    { "/a/%2e%2E/b", "b" },
+    { "/a%2fb", "a/b" },
+    { "/%41%62?x=%00", "Ab" },
+    { "/a#frag/../..", "a" },
+    { "/..", NULL },
+    { "/../etc/passwd", NULL },
+    { "/a/../../etc/passwd", NULL },
+    { "/%2e%2e/etc/passwd", NULL },
+    { "/%2e%2e%2fetc%2fpasswd", NULL },
+    { "/a/%2e%2e%2f%2e%2e/x", NULL },
+    { "/a%00.txt", NULL },
+    { "/a%0a", NULL },
+    { "/a\x01", NULL },
+    { "/a\x7f", NULL },
+    { "/a%7F", NULL },
+    { "/a%", NULL },
+    { "/a%4", NULL },
+    { "/a%zz", NULL },
+    { "a/b", NULL },
+    { "", NULL },
+};
+
+static void uri_fixed_cases(void) {
+    char path[PATH_MAX], query[MAXLINE];
+
+    for (size_t i = 0; i < sizeof(uri_cases) / sizeof(uri_cases[0]); i++) {
+        int rc = parse_uri(uri_cases[i].uri, path, sizeof(path), query, sizeof(query));
+        if (uri_cases[i].path == NULL ? rc == 0 : rc != 0 || strcmp(path, uri_cases[i].path) != 0) {
+            fprintf(report, "got rc %d \"%s\", expected \"%s\"\n", rc, rc ? "" : path,
+                    uri_cases[i].path ? uri_cases[i].path : "(rejected)");
+            fail("fixed case failed", uri_cases[i].uri, strlen(uri_cases[i].uri));
+        }
+        check_uri(uri_cases[i].uri, FUZZ_PATHSZ);
+    }
+
+    // Over-long: too long once decoded is refused without writing past the buffer
+    size_t n = PATH_MAX * 3;
+    char *lng = malloc(n + 1);
+    lng[0] = '/';
+    for (size_t i = 1; i < n; i++)
+        lng[i] = i % 3 == 1 ? '%' : i % 3 == 2 ? '4' : '1';
+    lng[n] = '\0';
+    if (parse_uri(lng, path, sizeof(path), query, sizeof(query)) == 0 && strlen(path) >= sizeof(path))
+        fail("over-long target overflowed", lng, n);
+    for (size_t len = 1; len < 40; len++) { // Every cut-off around a tiny buffer
+        lng[len] = '\0';
+        check_uri(lng, 8);
+        lng[len] = len % 3 == 1 ? '%' : len % 3 == 2 ? '4' : '1';
+    }
+    free(lng);
+}
+
+static const char *uri_tokens[] = {
+    "a", "b", "x.txt", "/", "/", "/", ".", "..", "%2e", "%2E", "%2f", "%2F", "%00", "%25", "%", "%4",
+    "%41", "%7f", "%ff", "?", "#", "&", "=", "\x01", "\x7f", "\xc3\xa9", " ", "%20", "~", "%3F", "%23",
+};
+
+static size_t random_uri(char *buf, size_t size) {
+    size_t len = 0, parts = rng_below(5) == 0 ? rng_below(600) : rng_below(24);
+
+    if (rng_below(50) != 0)
+        buf[len++] = '/';
+    while (parts-- > 0) {
+        const char *t;
+        char byte[2] = { (char)(rng_below(255) + 1), 0 };
+        t = rng_below(8) == 0 ? byte : uri_tokens[rng_below(sizeof(uri_tokens) / sizeof(uri_tokens[0]))];
+        size_t tlen = strlen(t);
+        if (len + tlen + 1 >= size)
+            break;
+        memcpy(buf + len, t, tlen);
+        len += tlen;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+static const char *header_samples[] = {
+    "Range: bytes=0-99", "Range: bytes=100-", "Range: bytes=9-0", "Range: bytes=-5", "Range: bytes=0-1,4-5",
+    "Range: bytes=99999999999999999999999-", "Content-Length: 10", "Content-Length: -1", "Content-Length: x",
+    "Content-Length: 99999999999999999999999", "Transfer-Encoding: chunked", "Transfer-Encoding: gzip, chunked",
+    "Expect: 100-continue", "Content-Range: bytes */100", "Content-Range: bytes 0-9/100",
+    "Content-Range: bytes 9-0/100", "Content-Range: bytes 0-/", "Content-Range: bytes */",
+    "If-None-Match: \"abc\"", "Accept-Encoding: gzip;q=0, br", "Accept-Encoding: ,,;q=", "Host: x",
+    "X-Forwarded-For: 1.2.3.4", ": empty", "NoColon",
+};
+
+// One request through a pipe, the way the server reads it from a socket
+static void check_request(const char *data, size_t len) {
+    int fds[2];
+    http_request *req = malloc(sizeof(http_request));
+
+    if (!req || pipe(fds) < 0) {
+        fprintf(report, "cwparse: pipe: %s\n", strerror(errno));
+        exit(1);
+    }
+    if (len > 60000) // Stays below the pipe capacity, no writer thread needed
+        len = 60000;
+    if (write(fds[1], data, len) != (ssize_t)len)
+        exit(1);
+    close(fds[1]);
+
+    if (parse_request(fds[0], req)) {
+        if (req->headers_len >= sizeof(req->headers) || strlen(req->headers) != req->headers_len)
+            fail("header block length is off", data, len);
+        size_t skip = 0, mlen = 0;
+        while (skip < len && (data[skip] == ' ' || data[skip] == '\t'))
+            skip++;
+        while (skip + mlen < len && !strchr(" \t\r\n", data[skip + mlen]))
+            mlen++;
+        if (strlen(req->method) != mlen)
+            fail("request method was cut short", data, len);
+        if (strnlen(req->method, sizeof(req->method)) == sizeof(req->method) ||
+            strnlen(req->filename, sizeof(req->filename)) == sizeof(req->filename))
+            fail("unterminated request field", data, len);
+        if (!path_is_clean(req->filename))
+            fail("parse_request passed an unclean path", data, len);
+        if (req->has_range && req->end != 0 && req->end <= (size_t)req->offset)
+            fail("empty Range accepted", data, len);
+        if (req->has_content_range && req->cr_first != -1 && (req->cr_first < 0 || req->cr_last < req->cr_first))
+            fail("bad Content-Range accepted", data, len);
+        if (req->content_length < -1)
+            fail("negative Content-Length accepted", data, len);
+    }
+    close(fds[0]);
+    free(req);
+}
+
+static size_t random_request(char *buf, size_t size) {
+    static const char *methods[] = { "GET", "HEAD", "PUT", "POST", "G\x01T", "",
+                                     "FIFTEEN-BYTES-X", "SIXTEEN-BYTES-XX" };
+    static const char *versions[] = { " HTTP/1.1", " HTTP/1.0", "", " HTTP/9", " junk junk" };
+    char uri[4096];
+    size_t len;
+
+    random_uri(uri, sizeof(uri));
+    len = snprintf(buf, size, "%s %s%s\r\n", methods[rng_below(8)], uri, versions[rng_below(5)]);
+    for (size_t h = rng_below(12); h > 0 && len + 2 * MAXLINE + 8 < size; h--) {
+        switch (rng_below(6)) {
+        case 0: { // Header line longer than the line buffer
+            size_t n = MAXLINE + rng_below(MAXLINE);
+            memcpy(buf + len, "X-Long: ", 8);
+            memset(buf + len + 8, 'z', n);
+            len += 8 + n;
+            break;
+        }
+        case 1: // Noise
+            for (size_t n = rng_below(64); n > 0; n--)
+                buf[len++] = (char)rng();
+            break;
+        default:
+            len += snprintf(buf + len, size - len, "%s",
+                            header_samples[rng_below(sizeof(header_samples) / sizeof(header_samples[0]))]);
+        }
+        memcpy(buf + len, rng_below(10) ? "\r\n" : "\n", 2);
+        len += buf[len] == '\r' ? 2 : 1;
+    }
+    if (rng_below(10) != 0)
+        len += snprintf(buf + len, size - len, "\r\n");
+    return len;
+}
+
+static void silence_server(void) {
+    report = fdopen(dup(STDERR_FILENO), "w");
+    setvbuf(report, NULL, _IONBF, 0);
+    if (!freopen("/dev/null", "w", stdout) || !freopen("/dev/null", "w", stderr))
+        exit(1);
+}
+
+#ifdef CW_LIBFUZZER
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *uri = malloc(size + 2);
+
+    if (!report)
+        silence_server();
+    uri[0] = '/';
+    memcpy(uri + 1, data, size);
+    uri[size + 1] = '\0';
+    check_uri(uri, FUZZ_PATHSZ);
+    check_uri(uri + 1, PATH_MAX);
+    free(uri);
+    check_request((const char *)data, size);
+    return 0;
+}
+
+#else
+
+static int run_fuzz(unsigned long iterations, uint64_t seed) {
+    char *buf = malloc(65536);
+
+    rng_state = seed ? seed : 1;
+    uri_fixed_cases();
+    for (unsigned long i = 0; i < iterations; i++) {
+        random_uri(buf, 8192);
+        check_uri(buf, rng_below(4) == 0 ? 16 : FUZZ_PATHSZ);
+        if (i % 8 == 0)
+            check_request(buf, random_request(buf, 65536));
+    }
+    fprintf(report, "cwparse: %lu targets and %lu requests, seed %llu, no mismatches\n",
+            iterations, (iterations + 7) / 8, (unsigned long long)seed);
+    free(buf);
+    return 0;
+}
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static double bench_case(const char *name, const char *uri, double ms) {
+    char path[PATH_MAX], query[MAXLINE];
+    volatile int sink = 0;
+    unsigned long calls = 0;
+    double start = now_ns(), end = start + ms * 1e6, t;
+
+    do {
+        for (int i = 0; i < 64; i++)
+            sink += parse_uri(uri, path, sizeof(path), query, sizeof(query));
+        calls += 64;
+    } while ((t = now_ns()) < end);
+    double ns = (t - start) / calls;
+    fprintf(report, "%-26s %6zu bytes %10.1f ns/call %8.1f MB/s\n", name, strlen(uri), ns, strlen(uri) / ns * 1e3);
+    (void)sink;
+    return ns;
+}
+
+// Same escape-heavy target at growing lengths: linear time keeps ns/byte flat,
+// so 8x the input taking more than 16x the time fails the run
+static int run_bench(double ms) {
+    static const char *typical[][2] = {
+        { "short", "/index.html" },
+        { "typical", "/pw/music/Artist/Album%20(2019)/01%20-%20Track.mp3?format=json" },
+        { "dot segments", "/a/./b/../c//d/./e/../../f/g.txt" },
+        { "traversal (rejected)", "/a/b/../../../etc/passwd" },
+    };
+    char *buf = malloc(3 * 1300 + 2);
+    double first = 0, last = 0;
+
+    fprintf(report, "parse_uri microbenchmark, %.0f ms per case\n", ms);
+    for (size_t i = 0; i < sizeof(typical) / sizeof(typical[0]); i++)
+        bench_case(typical[i][0], typical[i][1], ms);
+    for (size_t n = 100; n <= 1300; n *= 2) {
+        char name[32];
+        buf[0] = '/';
+        for (size_t i = 0; i < n; i++)
+            memcpy(buf + 1 + 3 * i, i % 16 == 15 ? "%2F" : "%41", 3);
+        buf[1 + 3 * n] = '\0';
+        snprintf(name, sizeof(name), "%zu escapes", n);
+        last = bench_case(name, buf, ms);
+        if (first == 0)
+            first = last;
+    }
+    free(buf);
+    fprintf(report, "8x longer escaped target: %.1fx the time\n", last / first);
+    return last / first > 16;
+}
+
+int main(int argc, char **argv) {
+    silence_server();
+    if (argc >= 2 && strcmp(argv[1], "fuzz") == 0)
+        return run_fuzz(argc > 2 ? strtoul(argv[2], NULL, 10) : 200000,
+                        argc > 3 ? strtoull(argv[3], NULL, 10) : (uint64_t)time(NULL));
+    if (argc >= 2 && strcmp(argv[1], "bench") == 0)
+        return run_bench(argc > 2 ? atof(argv[2]) : 200);
+    fprintf(report, "Usage: %s fuzz [iterations] [seed] | bench [ms_per_case]\n", argv[0]);
+    return 1;
+}
+
+#endif /* CW_LIBFUZZER */
@@ -0,0 +1,157 @@
+// cwupstream - stand-in HTTP upstream for tools/proxytest.sh
+//
+// Answers every request with 200 and a one-line body naming the upstream,
+// the connection and the request on it, so the test can tell which
+// upstream served a request and whether the proxy reused a connection.
+// Connections are kept alive (HTTP/1.1) until the client closes them.
+//
+//   cwupstream -p 9001 -n a          plain keep-alive upstream
+//   cwupstream -p 9002 -n b -k 2     closes every connection unanswered at its 2nd request
+//   cwupstream -p 9003 -n c -l hits  appends "name method path" to hits for every request
+//
+// A request target containing "sleep=ms" is answered after ms milliseconds.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+static const char *name = "upstream";
+static int drop_at = 0;             // -k, 0: never drop
+static int hits_fd = -1;            // -l, one line per request received
+static unsigned long connections = 0;
+
+// Reads up to the end of the header block. Returns its length, 0 on EOF.
+static ssize_t read_head(int fd, char *buf, size_t size, size_t *have) {
+    for (;;) {
+        char *end = memmem(buf, *have, "\r\n\r\n", 4);
+        if (end)
+            return end + 4 - buf;
+        if (*have == size - 1)
+            return -1;
+        ssize_t n = read(fd, buf + *have, size - 1 - *have);
+        if (n <= 0)
+            return n < 0 ? -1 : 0;
+        *have += n;
+        buf[*have] = '\0';
+    }
+}
+
+static void *serve(void *arg) {
+    int fd = (int)(long)arg;
+    unsigned long conn = __sync_add_and_fetch(&connections, 1);
+    char buf[16384], path[1024], body[1400], head[256];
+    size_t have = 0;
+    buf[0] = '\0';
+
+    for (int request = 1; ; request++) {
+        char method[16];
+        ssize_t hlen = read_head(fd, buf, sizeof(buf), &have);
+        if (hlen <= 0)
+            break;
+        if (sscanf(buf, "%15s %1023s", method, path) != 2)
+            break;
+        if (hits_fd >= 0) { // Counted even when dropped: the request did arrive
+            int len = snprintf(body, sizeof(body), "%s %s %s\n", name, method, path);
+            if (write(hits_fd, body, len) != len)
+                perror("hits");
+        }
+        if (drop_at && request == drop_at)
+            break; // Gone without a word, like an upstream whose idle timer fired
+
+        long long clen = 0;
+        char *h = strcasestr(buf, "\r\nContent-Length:");
+        if (h && h < buf + hlen)
+            clen = strtoll(h + 17, NULL, 10);
+
+        // Discard the request body
+        size_t rest = have - hlen;
+        while ((long long)rest < clen) {
+            char sink[4096];
+            ssize_t n = read(fd, sink, sizeof(sink));
+            if (n <= 0)
+                goto out;
+            rest += n;
+        }
+        size_t extra = rest - (size_t)clen; // Pipelined bytes of the next request
+        memmove(buf, buf + have - extra, extra);
+        have = extra;
+        buf[have] = '\0';
+
+        char *sleep_ms = strstr(path, "sleep=");
+        if (sleep_ms)
+            usleep(atoi(sleep_ms + 6) * 1000);
+
+        int blen = snprintf(body, sizeof(body), "%s conn=%lu req=%d path=%s\n", name, conn, request, path);
+        int len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+                           "Content-Length: %d\r\n\r\n", blen);
+        if (write(fd, head, len) != len || write(fd, body, blen) != blen)
+            break;
+    }
+out:
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -p port [-n name] [-k drop_at_request] [-l hits_file]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    struct sockaddr_in addr;
+    int port = 0, opt, one = 1;
+
+    while ((opt = getopt(argc, argv, "k:l:n:p:")) != -1) {
+        switch (opt) {
+        case 'k': drop_at = atoi(optarg); break;
+        case 'l':
+            if ((hits_fd = open(optarg, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0) {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        case 'n': name = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (port <= 0)
+        usage(argv[0]);
+    signal(SIGPIPE, SIG_IGN);
+
+    int lfd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (lfd < 0 || bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 64) < 0) {
+        perror("cwupstream");
+        return 1;
+    }
+
+    for (;;) {
+        pthread_t tid;
+        int fd = accept(lfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+        if (pthread_create(&tid, NULL, serve, (void *)(long)fd) != 0) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(tid);
+    }
+}
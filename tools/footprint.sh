@@ -0,0 +1,151 @@
+#!/bin/sh
+# footprint.sh - memory and throughput check for cwserver
+#
+# Starts cwserver in a fresh memory cgroup (v1 or v2) limited to MEM_LIMIT,
+# drives it with cwload at each concurrency level in LEVELS, and prints the
+# peak RSS, cgroup peak, requests/sec and latency after every level.
+# Exits 1 when the server dies or a BUDGET_* value is exceeded. Failed
+# requests (non-2xx such as 503, resets, timeouts) are held to BUDGET_ERRORS
+# at every level up to the server's connection limit; levels above it are
+# expected to be turned away and only reported.
+#
+#   make PROFILE=tiny footprint
+#   BUDGET_RSS_KB=4096 BUDGET_P99_MS=50 sh tools/footprint.sh ./cwserver ./cwload
+#
+# Settings (environment):
+#   LEVELS          Concurrency levels, in order (default "1 8 32")
+#   DURATION        Seconds per level (default 5)
+#   MEM_LIMIT       cgroup memory limit in bytes, K/M/G suffix allowed (default 32M)
+#   PORT            Listen port (default 18080)
+#   PATHS           Requested paths, used round robin (default "/ /small.bin /big.bin")
+#   SERVER_ARGS     Extra cwserver options, e.g. "-s -f secret"
+#   BUDGET_RSS_KB   Max peak RSS of the server (0: not checked)
+#   BUDGET_P99_MS   Max 99th percentile latency at any level (0: not checked)
+#   BUDGET_MIN_RPS  Min requests/sec at any level (0: not checked)
+#   BUDGET_ERRORS   Max failed requests at a level within MAX_CONNECTIONS (default 0)
+#   MAX_CONNECTIONS Connection limit of the server (default: read from cwserver -v,
+#                   0: unlimited, every level is checked)
+#   OUT             Append the results to this file as well
+
+SERVER=${1:-./cwserver}
+CWLOAD=${2:-./cwload}
+LEVELS=${LEVELS:-"1 8 32"}
+DURATION=${DURATION:-5}
+MEM_LIMIT=${MEM_LIMIT:-32M}
+PORT=${PORT:-18080}
+PATHS=${PATHS:-"/ /small.bin /big.bin"}
+BUDGET_RSS_KB=${BUDGET_RSS_KB:-0}
+BUDGET_P99_MS=${BUDGET_P99_MS:-0}
+BUDGET_MIN_RPS=${BUDGET_MIN_RPS:-0}
+BUDGET_ERRORS=${BUDGET_ERRORS:-0}
+
+CG=
+PEAK_FILE=
+PID=
+FAILED=0
+
+die() {
+    echo "footprint: $*" >&2
+    exit 1
+}
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+    [ -n "$CG" ] && rmdir "$CG" 2>/dev/null
+    [ -n "$ROOT" ] && rm -rf "$ROOT"
+}
+
+# Peak RSS of the server in kB, from /proc
+status_kb() {
+    awk -v key="$1:" '$1 == key { print $2 }' "/proc/$PID/status" 2>/dev/null
+}
+
+[ -x "$SERVER" ] || die "$SERVER: not executable (make cwserver)"
+[ -x "$CWLOAD" ] || die "$CWLOAD: not executable (make cwload)"
+if [ -z "$MAX_CONNECTIONS" ]; then
+    MAX_CONNECTIONS=$("$SERVER" -v 2>/dev/null | sed -n 's/.*max connections \([0-9]*\).*/\1/p')
+    [ -n "$MAX_CONNECTIONS" ] || die "cannot read the connection limit from $SERVER -v, set MAX_CONNECTIONS"
+fi
+
+case $MEM_LIMIT in
+    *K) LIMIT_BYTES=$(( ${MEM_LIMIT%K} * 1024 )) ;;
+    *M) LIMIT_BYTES=$(( ${MEM_LIMIT%M} * 1024 * 1024 )) ;;
+    *G) LIMIT_BYTES=$(( ${MEM_LIMIT%G} * 1024 * 1024 * 1024 )) ;;
+    *)  LIMIT_BYTES=$MEM_LIMIT ;;
+esac
+
+# The web root has to be below ALLOWED_ROOT_PREFIX, /tmp by default
+ROOT=$(mktemp -d /tmp/cwfoot.XXXXXX) || die "mktemp failed"
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+if [ -f index.html ]; then
+    cp index.html "$ROOT/index.html"
+else
+    head -c 4096 /dev/zero | tr '\0' 'x' > "$ROOT/index.html"
+fi
+head -c 16384 /dev/urandom > "$ROOT/small.bin"
+head -c 4194304 /dev/urandom > "$ROOT/big.bin"
+
+if [ -w /sys/fs/cgroup/memory ]; then
+    CG=/sys/fs/cgroup/memory/cwfoot.$$
+    mkdir "$CG" && echo "$LIMIT_BYTES" > "$CG/memory.limit_in_bytes" || die "cannot set up $CG"
+    PEAK_FILE=$CG/memory.max_usage_in_bytes
+elif grep -qw memory /sys/fs/cgroup/cgroup.controllers 2>/dev/null && [ -w /sys/fs/cgroup ]; then
+    CG=/sys/fs/cgroup/cwfoot.$$
+    mkdir "$CG" && echo "$LIMIT_BYTES" > "$CG/memory.max" || die "cannot set up $CG"
+    PEAK_FILE=$CG/memory.peak
+else
+    echo "footprint: no writable memory cgroup, running without a limit" >&2
+fi
+
+# The child joins the cgroup itself, then becomes the server
+sh -c '[ -n "$0" ] && echo $$ > "$0/cgroup.procs"; exec "$@"' "$CG" \
+    "$SERVER" -p "$PORT" -w "$ROOT" $SERVER_ARGS > /dev/null 2> "$ROOT.log" &
+PID=$!
+
+sleep 1
+kill -0 "$PID" 2>/dev/null || die "server did not start: $(cat "$ROOT.log")"
+"$CWLOAD" -p "$PORT" -c 1 -d 1 $PATHS > /dev/null # Warm up the page cache
+
+echo "cwserver footprint: $SERVER, limit $MEM_LIMIT, max connections $MAX_CONNECTIONS, ${DURATION}s per level, paths: $PATHS"
+printf '%6s %9s %7s %8s %8s %8s %8s %11s %10s %10s\n' \
+    conc requests errors req/s p50_ms p99_ms max_ms peak_rss_kb cg_peak_kb vm_peak_kb
+for level in $LEVELS; do
+    line=$("$CWLOAD" -p "$PORT" -c "$level" -d "$DURATION" $PATHS) || die "cwload failed"
+    if ! kill -0 "$PID" 2>/dev/null; then
+        echo "footprint: server died at concurrency $level (out of memory?)" >&2
+        FAILED=1
+        break
+    fi
+    rss=$(status_kb VmHWM)
+    vm=$(status_kb VmPeak)
+    cg=-
+    [ -n "$PEAK_FILE" ] && [ -r "$PEAK_FILE" ] && cg=$(( $(cat "$PEAK_FILE") / 1024 ))
+
+    eval "$(echo "$line" | tr ' ' '\n' | sed -n 's/^\([a-z0-9_]*\)=\([0-9.]*\)$/\1=\2/p')"
+    printf '%6s %9s %7s %8s %8s %8s %8s %11s %10s %10s\n' \
+        "$level" "$requests" "$errors" "$rps" "$p50_ms" "$p99_ms" "$max_ms" "$rss" "$cg" "$vm"
+    [ -n "$OUT" ] && echo "$(date +%Y-%m-%dT%H:%M:%S) server=$SERVER limit=$MEM_LIMIT $line peak_rss_kb=$rss cg_peak_kb=$cg vm_peak_kb=$vm" >> "$OUT"
+
+    if [ "$BUDGET_P99_MS" != 0 ] && awk -v a="$p99_ms" -v b="$BUDGET_P99_MS" 'BEGIN { exit !(a > b) }'; then
+        echo "footprint: p99 ${p99_ms}ms at concurrency $level is over the ${BUDGET_P99_MS}ms budget" >&2
+        FAILED=1
+    fi
+    if { [ "$MAX_CONNECTIONS" = 0 ] || [ "$level" -le "$MAX_CONNECTIONS" ]; } && [ "$errors" -gt "$BUDGET_ERRORS" ]; then
+        echo "footprint: $errors failed requests at concurrency $level is over the budget of $BUDGET_ERRORS" >&2
+        FAILED=1
+    fi
+    if [ "$BUDGET_MIN_RPS" != 0 ] && awk -v a="$rps" -v b="$BUDGET_MIN_RPS" 'BEGIN { exit !(a < b) }'; then
+        echo "footprint: ${rps} req/s at concurrency $level is under the ${BUDGET_MIN_RPS} req/s budget" >&2
+        FAILED=1
+    fi
+done
+
+if [ "$BUDGET_RSS_KB" != 0 ] && [ -n "$rss" ] && [ "$rss" -gt "$BUDGET_RSS_KB" ]; then
+    echo "footprint: peak RSS ${rss}kB is over the ${BUDGET_RSS_KB}kB budget" >&2
+    FAILED=1
+fi
+rm -f "$ROOT.log"
+
+[ "$FAILED" = 0 ] && echo "footprint: within budget"
+exit "$FAILED"
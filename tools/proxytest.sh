@@ -0,0 +1,145 @@
+#!/bin/sh
+# proxytest.sh - reverse proxy check for cwserver against tools/cwupstream
+#
+# Starts five stand-in upstreams and a cwserver with one -P route per case,
+# then checks:
+#   pooling   sequential requests to one upstream share one connection
+#   stale     a pooled connection the upstream drops is retried on a fresh one
+#   failover  a route whose first upstream is down still answers every request
+#   timeout   a response slower than PROXY_IO_TIMEOUT gives 504
+#   once      a POST or DELETE that reached an upstream is never sent again,
+#             a GET fails over; counted from the upstreams' hit logs
+# Exits 1 on the first failed check. Needs curl.
+#
+#   make proxytest
+#   sh tools/proxytest.sh ./cwserver-proxytest ./cwupstream
+#
+# The server has to be built with -DPROXY_IO_TIMEOUT=2 (make proxytest does),
+# otherwise the timeout case waits for the default 30 s and fails.
+#
+# Settings (environment):
+#   PORT            First of seven consecutive ports used (default 18180)
+
+SERVER=${1:-./cwserver-proxytest}
+UPSTREAM=${2:-./cwupstream}
+PORT=${PORT:-18180}
+PIDS=
+
+die() {
+    echo "proxytest: $*" >&2
+    [ -n "$ROOT" ] && [ -f "$ROOT.log" ] && sed 's/^/  server: /' "$ROOT.log" | tail -20 >&2
+    exit 1
+}
+
+cleanup() {
+    for pid in $PIDS; do
+        kill "$pid" 2>/dev/null && wait "$pid" 2>/dev/null
+    done
+    [ -n "$ROOT" ] && rm -rf "$ROOT" "$ROOT.log" "$ROOT.hits"
+}
+
+# get PATH: prints the body and status of one request through the proxy
+get() {
+    curl -s -m 10 -w ' %{http_code}' "http://127.0.0.1:$PORT$1"
+}
+
+# hits METHOD PATH: how many times the request reached any upstream
+hits() {
+    grep -c " $1 $2\$" "$ROOT.hits"
+}
+
+[ -x "$SERVER" ] || die "$SERVER: not executable (make cwserver-proxytest)"
+[ -x "$UPSTREAM" ] || die "$UPSTREAM: not executable (make cwupstream)"
+command -v curl > /dev/null || die "curl not found"
+
+A=$((PORT + 1)) B=$((PORT + 2)) C=$((PORT + 3)) DEAD=$((PORT + 4)) D=$((PORT + 5)) E=$((PORT + 6))
+
+# The web root has to be below ALLOWED_ROOT_PREFIX, /tmp by default
+ROOT=$(mktemp -d /tmp/cwproxy.XXXXXX) || die "mktemp failed"
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+"$UPSTREAM" -p "$A" -n a & PIDS="$PIDS $!"
+"$UPSTREAM" -p "$B" -n b -k 2 -l "$ROOT.hits" & PIDS="$PIDS $!"
+"$UPSTREAM" -p "$C" -n c & PIDS="$PIDS $!"
+"$UPSTREAM" -p "$D" -n d -k 1 -l "$ROOT.hits" & PIDS="$PIDS $!" # Takes every request, answers none
+"$UPSTREAM" -p "$E" -n e -l "$ROOT.hits" & PIDS="$PIDS $!"
+"$SERVER" -p "$PORT" -w "$ROOT" \
+    -P "/pool=127.0.0.1:$A" \
+    -P "/stale=127.0.0.1:$B" \
+    -P "/failover=127.0.0.1:$DEAD,127.0.0.1:$C" \
+    -P "/slow=127.0.0.1:$C" \
+    -P "/get=127.0.0.1:$D,127.0.0.1:$E" \
+    -P "/delete=127.0.0.1:$D,127.0.0.1:$E" \
+    -P "/post=127.0.0.1:$D,127.0.0.1:$E" > /dev/null 2> "$ROOT.log" &
+PIDS="$PIDS $!"
+sleep 1
+kill -0 $PIDS 2>/dev/null || die "server or upstreams did not start"
+
+# pooling: after the first request every one reuses connection 1
+for i in 1 2 3 4 5; do
+    out=$(get /pool/x)
+    case $out in
+        "a conn=1 req=$i path=/pool/x"*" 200") ;;
+        *) die "pooling: request $i got '$out', expected a conn=1 req=$i" ;;
+    esac
+done
+echo "proxytest: pooling ok"
+
+# stale: upstream b drops every connection at its second request, each
+# request must still succeed on a fresh connection
+for i in 1 2 3 4 5; do
+    out=$(get /stale/x)
+    case $out in
+        "b conn="*" req=1 path=/stale/x"*" 200") ;;
+        *) die "stale: request $i got '$out', expected a retry on a fresh connection" ;;
+    esac
+done
+echo "proxytest: stale pooled connection ok"
+
+# once: each route tries d first, which takes the request and drops it
+out=$(get /get/x)
+case $out in
+    "e conn="*" 200") ;;
+    *) die "once: GET got '$out', expected a failover to upstream e" ;;
+esac
+[ "$(hits GET /get/x)" = 2 ] || die "once: GET reached the upstreams $(hits GET /get/x) times, expected 2"
+out=$(curl -s -m 10 -w ' %{http_code}' -X DELETE "http://127.0.0.1:$PORT/delete/x")
+case $out in
+    *" 502") ;;
+    *) die "once: DELETE got '$out', expected 502" ;;
+esac
+[ "$(hits DELETE /delete/x)" = 1 ] || die "once: DELETE reached the upstreams $(hits DELETE /delete/x) times"
+out=$(curl -s -m 10 -w ' %{http_code}' --data-binary "one order" "http://127.0.0.1:$PORT/post/x")
+case $out in
+    *" 502") ;;
+    *) die "once: POST got '$out', expected 502" ;;
+esac
+[ "$(hits POST /post/x)" = 1 ] || die "once: POST reached the upstreams $(hits POST /post/x) times"
+# b's pooled connection from the stale case drops this POST, no retry either
+out=$(curl -s -m 10 -w ' %{http_code}' --data-binary "one order" "http://127.0.0.1:$PORT/stale/p")
+case $out in
+    *" 502") ;;
+    *) die "once: POST on a stale pooled connection got '$out', expected 502" ;;
+esac
+[ "$(hits POST /stale/p)" = 1 ] || die "once: POST /stale/p reached the upstream $(hits POST /stale/p) times"
+echo "proxytest: non-idempotent requests sent once ok"
+
+# failover: the dead upstream is skipped, then marked down
+for i in 1 2 3 4 5 6; do
+    out=$(get /failover/x)
+    case $out in
+        "c conn="*" 200") ;;
+        *) die "failover: request $i got '$out', expected upstream c" ;;
+    esac
+done
+grep -q "marked down" "$ROOT.log" || die "failover: dead upstream was never marked down"
+echo "proxytest: failover ok"
+
+# timeout: the upstream answers after 4 s, PROXY_IO_TIMEOUT is 2 s
+out=$(get "/slow/x?sleep=4000")
+case $out in
+    *" 504") ;;
+    *) die "timeout: got '$out', expected 504" ;;
+esac
+echo "proxytest: timeout ok"
@@ -0,0 +1,102 @@
+#!/bin/sh
+# searchtest.sh - filename search check for cwserver (-s)
+#
+# Builds a small web root, starts cwserver with the search index and
+# checks ?search= answers from the protected directory view:
+#   words     a multi-word needle sent the way the search form does ('+')
+#             and percent-encoded, both match
+#   plus      a literal '+' (%2B) in a needle is kept
+#   scope     matches are limited to the directory searched from
+#   short     1 and 2 byte needles, from the root and from a subtree
+#   changes   removed files and directories drop out, re-created ones return
+# Exits 1 on the first failed check. Needs curl.
+#
+#   make searchtest
+#   sh tools/searchtest.sh ./cwserver-host
+#
+# Settings (environment):
+#   PORT            Listen port (default 18190)
+
+SERVER=${1:-./cwserver-host}
+PORT=${PORT:-18190}
+PID=
+
+die() {
+    echo "searchtest: $*" >&2
+    [ -n "$ROOT" ] && [ -f "$ROOT.log" ] && sed 's/^/  server: /' "$ROOT.log" | tail -20 >&2
+    exit 1
+}
+
+cleanup() {
+    [ -n "$PID" ] && kill "$PID" 2>/dev/null && wait "$PID" 2>/dev/null
+    [ -n "$ROOT" ] && rm -rf "$ROOT" "$ROOT.log"
+}
+
+# search DIR QUERY: JSON answer for ?search=QUERY (already encoded) below DIR
+search() {
+    curl -s -m 10 "http://127.0.0.1:$PORT/pw/$1?format=json&search=$2"
+}
+
+# expect NAME DIR QUERY NAMES...: the answer lists exactly NAMES, in any order
+expect() {
+    check=$1 dir=$2 query=$3
+    shift 3
+    out=$(search "$dir" "$query")
+    got=$(echo "$out" | tr '{' '\n' | sed -n 's/^"name":"\([^"]*\)".*/\1/p' | sort | tr '\n' ' ')
+    want=$(for n in "$@"; do echo "$n"; done | sort | tr '\n' ' ')
+    [ "$got" = "$want" ] || die "$check: ?search=$query in /$dir got '$got', expected '$want'"
+}
+
+[ -x "$SERVER" ] || die "$SERVER: not executable (make cwserver-host)"
+command -v curl > /dev/null || die "curl not found"
+
+# The web root has to be below ALLOWED_ROOT_PREFIX, /tmp by default
+ROOT=$(mktemp -d /tmp/cwsearch.XXXXXX) || die "mktemp failed"
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+mkdir -p "$ROOT/docs/deep/er" "$ROOT/media"
+: > "$ROOT/docs/weird name.txt"
+: > "$ROOT/docs/deep/er/another weird name.md"
+: > "$ROOT/media/weird name.mp4"
+: > "$ROOT/media/c++ notes.txt"
+
+"$SERVER" -p "$PORT" -w "$ROOT" -f pw -s > /dev/null 2> "$ROOT.log" &
+PID=$!
+sleep 1
+kill -0 "$PID" 2>/dev/null || die "server did not start"
+
+expect words "" "ird+name" \
+    "docs/weird name.txt" "docs/deep/er/another weird name.md" "media/weird name.mp4"
+expect words "" "ird%20name" \
+    "docs/weird name.txt" "docs/deep/er/another weird name.md" "media/weird name.mp4"
+echo "searchtest: multi-word needles ok"
+
+expect plus "" "c%2B%2B" "media/c++ notes.txt"
+expect plus "" "c++" # Two spaces after the c, no such name
+echo "searchtest: literal plus ok"
+
+expect scope "docs/" "weird+name" "weird name.txt" "deep/er/another weird name.md"
+expect scope "docs/deep/" "weird" "er/another weird name.md"
+expect scope "docs/deep/er/" "name" "another weird name.md"
+expect scope "nosuchdir/" "name"
+echo "searchtest: scope ok"
+
+expect short "" "mp" "media/weird name.mp4"
+expect short "docs/" "md" "deep/er/another weird name.md"
+expect short "docs/deep/" "e" "er" "er/another weird name.md"
+expect short "media/" "+" "c++ notes.txt" "weird name.mp4"
+echo "searchtest: short needles ok"
+
+rm "$ROOT/media/weird name.mp4"
+rm -r "$ROOT/docs/deep"
+sleep 0.5
+expect changes "" "weird" "docs/weird name.txt"
+expect changes "docs/" "er"
+mkdir -p "$ROOT/docs/deep/er"
+sleep 0.2
+: > "$ROOT/docs/deep/er/back again.md"
+sleep 0.5
+expect changes "docs/deep/" "again" "er/back again.md"
+expect changes "docs/" "a" "weird name.txt" "deep/er/back again.md"
+echo "searchtest: changes ok"